@@ -18,10 +18,15 @@
 
 #include "browser-app.hpp"
 #include "browser-version.h"
+#include "browser-shared-channel.hpp"
 #include <nlohmann/json.hpp>
+#include <chrono>
+#include <cstring>
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #ifdef ENABLE_BROWSER_QT_LOOP
@@ -29,6 +34,9 @@
 #include <util/platform.h>
 #include <util/threading.h>
 #include <QTimer>
+#include <algorithm>
+#include <cinttypes>
+#include <iterator>
 #endif
 
 #ifndef UNUSED_PARAMETER
@@ -99,44 +107,248 @@ void BrowserApp::OnBeforeCommandLineProcessing(const CefString &, CefRefPtr<CefC
 #endif
 }
 
-std::vector<std::string> exposedFunctions = {"getControlLevel",     "getCurrentScene",  "getStatus",
-					     "startRecording",      "stopRecording",    "startStreaming",
-					     "stopStreaming",       "pauseRecording",   "unpauseRecording",
-					     "startReplayBuffer",   "stopReplayBuffer", "saveReplayBuffer",
-					     "startVirtualcam",     "stopVirtualcam",   "getScenes",
-					     "setCurrentScene",     "getTransitions",   "getCurrentTransition",
-					     "setCurrentTransition"};
+/* obsstudio functions handled by the renderer itself */
+static const char *localFunctions[] = {
+	"batch",
+	"subscribe",
+	"getDiagnostics",
+	"readSharedChannel",
+};
+
+/* obsstudio functions of a context, created the first time they are used */
+class FunctionCache : public CefBaseRefCounted {
+public:
+	std::unordered_map<std::string, CefRefPtr<CefV8Value>> functions;
+
+	IMPLEMENT_REFCOUNTING(FunctionCache);
+};
+
+static void AddFunctionAccessor(CefRefPtr<CefV8Value> object, const char *name)
+{
+#if CHROME_VERSION_BUILD >= 5060
+	object->SetValue(name, V8_PROPERTY_ATTRIBUTE_NONE);
+#else
+	object->SetValue(name, V8_ACCESS_CONTROL_DEFAULT, V8_PROPERTY_ATTRIBUTE_NONE);
+#endif
+}
+
+/* Evaluated once per context, before any script of the page runs, so the
+ * dispatcher keeps working if the page replaces these globals */
+static const char *dispatcherScript = "(function () {"
+				      "  const dispatchEvent = EventTarget.prototype.dispatchEvent;"
+				      "  const apply = Reflect.apply;"
+				      "  const parse = JSON.parse;"
+				      "  const Event = CustomEvent;"
+				      "  const target = window;"
+				      "  return function (name, detail, binary) {"
+				      "    detail = binary ? detail : parse(detail);"
+				      "    apply(dispatchEvent, target, [new Event(name, {detail: detail})]);"
+				      "  };"
+				      "})()";
+
+struct ExposedFunction {
+	const char *name;
+	ControlLevel level;
+};
+
+static const std::vector<ExposedFunction> exposedFunctions = {
+	{"getControlLevel", ControlLevel::None},
+	{"getCurrentScene", ControlLevel::ReadUser},
+	{"getStatus", ControlLevel::ReadObs},
+	{"startRecording", ControlLevel::All},
+	{"stopRecording", ControlLevel::All},
+	{"startStreaming", ControlLevel::All},
+	{"stopStreaming", ControlLevel::All},
+	{"pauseRecording", ControlLevel::All},
+	{"unpauseRecording", ControlLevel::All},
+	{"startReplayBuffer", ControlLevel::Advanced},
+	{"stopReplayBuffer", ControlLevel::Advanced},
+	{"saveReplayBuffer", ControlLevel::Basic},
+	{"startVirtualcam", ControlLevel::All},
+	{"stopVirtualcam", ControlLevel::All},
+	{"getScenes", ControlLevel::ReadUser},
+	{"setCurrentScene", ControlLevel::Advanced},
+	{"getTransitions", ControlLevel::ReadUser},
+	{"getCurrentTransition", ControlLevel::ReadUser},
+	{"setCurrentTransition", ControlLevel::Advanced},
+};
+
+bool GetFunctionControlLevel(const std::string &function, ControlLevel &level)
+{
+	for (const ExposedFunction &exposed : exposedFunctions) {
+		if (function == exposed.name) {
+			level = exposed.level;
+			return true;
+		}
+	}
+	return false;
+}
 
-void BrowserApp::OnContextCreated(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame>, CefRefPtr<CefV8Context> context)
+void BrowserApp::OnBrowserCreated(CefRefPtr<CefBrowser> browser, CefRefPtr<CefDictionaryValue> extra_info)
+{
+	if (extra_info && extra_info->HasKey("controlLevel"))
+		controlLevels[browser->GetIdentifier()] = (ControlLevel)extra_info->GetInt("controlLevel");
+}
+
+void BrowserApp::OnBrowserDestroyed(CefRefPtr<CefBrowser> browser)
+{
+	const int id = browser->GetIdentifier();
+	controlLevels.erase(id);
+	frameContexts.erase(id);
+	subscriptions.erase(id);
+	sharedChannels.erase(id);
+	stateSnapshots.erase(id);
+}
+
+void BrowserApp::OnContextCreated(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
+				  CefRefPtr<CefV8Context> context)
 {
 	CefRefPtr<CefV8Value> globalObj = context->GetGlobal();
 
-	CefRefPtr<CefV8Value> obsStudioObj = CefV8Value::CreateObject(nullptr, nullptr);
+	CefRefPtr<CefV8Value> obsStudioObj = CefV8Value::CreateObject(this, nullptr);
+	obsStudioObj->SetUserData(new FunctionCache());
 	globalObj->SetValue("obsstudio", obsStudioObj, V8_PROPERTY_ATTRIBUTE_NONE);
 
 	CefRefPtr<CefV8Value> pluginVersion = CefV8Value::CreateString(OBS_BROWSER_VERSION_STRING);
 	obsStudioObj->SetValue("pluginVersion", pluginVersion, V8_PROPERTY_ATTRIBUTE_NONE);
 
-	for (std::string name : exposedFunctions) {
-		CefRefPtr<CefV8Value> func = CefV8Value::CreateFunction(name, this);
-		obsStudioObj->SetValue(name, func, V8_PROPERTY_ATTRIBUTE_NONE);
+	/* Functions are only created once the page uses them, see Get() */
+	for (const ExposedFunction &exposed : exposedFunctions)
+		AddFunctionAccessor(obsStudioObj, exposed.name);
+	for (const char *name : localFunctions)
+		AddFunctionAccessor(obsStudioObj, name);
+
+	FrameContext frameContext;
+	frameContext.context = context;
+	frameContext.main = frame->IsMain();
+
+	CefRefPtr<CefV8Exception> exception;
+	context->Eval(dispatcherScript, CefString(), 0, frameContext.dispatchEvent, exception);
+	frameContexts[browser->GetIdentifier()].push_back(frameContext);
+
+	if (frame->IsMain()) {
+		/* New document, go back to receiving every event until the
+		 * page subscribes to something */
+		subscriptions.erase(browser->GetIdentifier());
+
+		auto channel = sharedChannels.find(browser->GetIdentifier());
+		if (channel != sharedChannels.end())
+			ExposeSharedChannel(context, channel->second);
+
+		CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("DocumentCreated");
+		SendBrowserProcessMessage(browser, PID_BROWSER, msg);
 	}
+}
 
-	UNUSED_PARAMETER(browser);
+void BrowserApp::OnContextReleased(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
+				   CefRefPtr<CefV8Context> context)
+{
+	/* Pages still holding the buffer keep it mapped through its release
+	 * callback, the browser sends the channel and state again for the next
+	 * document */
+	if (frame->IsMain()) {
+		sharedChannels.erase(browser->GetIdentifier());
+		stateSnapshots.erase(browser->GetIdentifier());
+	}
+
+	/* Callbacks of this context can never be called anymore */
+	callbackMap.RemoveIf(
+		[&](const PendingCallback &pending, uint64_t) { return pending.context->IsSame(context); });
+
+	auto it = frameContexts.find(browser->GetIdentifier());
+	if (it == frameContexts.end())
+		return;
+
+	std::vector<FrameContext> &frames = it->second;
+	for (auto frameContext = frames.begin(); frameContext != frames.end(); ++frameContext) {
+		if (frameContext->context->IsSame(context)) {
+			frames.erase(frameContext);
+			break;
+		}
+	}
+
+	if (frames.empty())
+		frameContexts.erase(it);
+}
+
+void BrowserApp::InvalidateSnapshot(CefRefPtr<CefBrowser> browser)
+{
+	/* The version is kept so that snapshots still on their way are
+	 * told apart from newer ones */
+	auto snapshot = stateSnapshots.find(browser->GetIdentifier());
+	if (snapshot != stateSnapshots.end())
+		snapshot->second.values.clear();
+}
+
+void BrowserApp::Subscribe(CefRefPtr<CefV8Context> context, const CefV8ValueList &arguments)
+{
+	CefRefPtr<CefBrowser> browser = context->GetBrowser();
+	bool first = subscriptions.find(browser->GetIdentifier()) == subscriptions.end();
+	EventSubscriptions &subs = subscriptions[browser->GetIdentifier()];
+
+	CefRefPtr<CefListValue> names = CefListValue::Create();
+	auto addName = [&](CefRefPtr<CefV8Value> value) {
+		if (!value->IsString())
+			return;
+
+		std::string name = value->GetStringValue();
+		if (subs.names.insert(name).second)
+			names->SetString(names->GetSize(), name);
+	};
+
+	for (auto &argument : arguments) {
+		if (argument->IsArray()) {
+			for (int i = 0; i < argument->GetArrayLength(); i++)
+				addName(argument->GetValue(i));
+		} else {
+			addName(argument);
+		}
+	}
+
+	FrameContext *frameContext = GetFrameContext(context);
+	if (frameContext)
+		frameContext->subscribed = true;
+
+	/* Only tell the browser process about names it hasn't seen yet */
+	if (!first && !names->GetSize())
+		return;
+
+	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("Subscribe");
+	CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	args->SetList(0, names);
+	SendBrowserProcessMessage(browser, PID_BROWSER, msg);
+}
+
+bool BrowserApp::WantsEvents(CefRefPtr<CefBrowser> browser, const FrameContext &frame)
+{
+	return frame.main || frame.subscribed || subscriptions.find(browser->GetIdentifier()) == subscriptions.end();
+}
+
+BrowserApp::FrameContext *BrowserApp::GetFrameContext(CefRefPtr<CefV8Context> context)
+{
+	auto it = frameContexts.find(context->GetBrowser()->GetIdentifier());
+	if (it == frameContexts.end())
+		return nullptr;
+
+	for (FrameContext &frameContext : it->second) {
+		if (frameContext.context->IsSame(context))
+			return &frameContext;
+	}
+	return nullptr;
 }
 
 void BrowserApp::ExecuteJSFunction(CefRefPtr<CefBrowser> browser, const char *functionName, CefV8ValueList arguments)
 {
-	std::vector<CefString> names;
-	browser->GetFrameNames(names);
-	for (auto &name : names) {
-		CefRefPtr<CefFrame> frame =
-#if CHROME_VERSION_BUILD >= 6261
-			browser->GetFrameByName(name);
-#else
-			browser->GetFrame(name);
-#endif
-		CefRefPtr<CefV8Context> context = frame->GetV8Context();
+	auto it = frameContexts.find(browser->GetIdentifier());
+	if (it == frameContexts.end())
+		return;
+
+	/* Copied, the page can add or remove frames from the function */
+	std::vector<FrameContext> frames = it->second;
+	for (const FrameContext &frameContext : frames) {
+		CefRefPtr<CefV8Context> context = frameContext.context;
+		if (!context->IsValid())
+			continue;
 
 		context->Enter();
 
@@ -151,6 +363,78 @@ void BrowserApp::ExecuteJSFunction(CefRefPtr<CefBrowser> browser, const char *fu
 	}
 }
 
+class FreeBufferCallback : public CefV8ArrayBufferReleaseCallback {
+public:
+	virtual void ReleaseBuffer(void *buffer) override { free(buffer); }
+
+	IMPLEMENT_REFCOUNTING(FreeBufferCallback);
+};
+
+/* Keeps the shared memory mapped for as long as V8 uses it */
+class SharedMemoryReleaseCallback : public CefV8ArrayBufferReleaseCallback {
+	std::shared_ptr<SharedMemory> memory;
+
+public:
+	inline SharedMemoryReleaseCallback(std::shared_ptr<SharedMemory> memory_) : memory(memory_) {}
+	virtual void ReleaseBuffer(void *) override { memory.reset(); }
+
+	IMPLEMENT_REFCOUNTING(SharedMemoryReleaseCallback);
+};
+
+static CefRefPtr<CefV8Value> CreateArrayBufferCopy(const void *data, size_t size)
+{
+#if CHROME_VERSION_BUILD >= 6367
+	return CefV8Value::CreateArrayBufferWithCopy(const_cast<void *>(data), size);
+#else
+	void *copy = malloc(size ? size : 1);
+	if (!copy)
+		return CefV8Value::CreateNull();
+	if (size)
+		memcpy(copy, data, size);
+	return CefV8Value::CreateArrayBuffer(copy, size, new FreeBufferCallback());
+#endif
+}
+
+void BrowserApp::ExposeSharedChannel(CefRefPtr<CefV8Context> context, std::shared_ptr<SharedMemory> memory)
+{
+#if CHROME_VERSION_BUILD < 6367
+	/* Newer V8 versions can't wrap memory they didn't allocate, pages
+	 * have to use obsstudio.readSharedChannel() there instead */
+	if (!context->Enter())
+		return;
+
+	CefRefPtr<CefV8Value> obsStudioObj = context->GetGlobal()->GetValue("obsstudio");
+	if (obsStudioObj && obsStudioObj->IsObject()) {
+		CefRefPtr<CefV8Value> buffer = CefV8Value::CreateArrayBuffer(
+			memory->Data(), memory->Size(), new SharedMemoryReleaseCallback(memory));
+		if (buffer)
+			obsStudioObj->SetValue("sharedChannel", buffer, V8_PROPERTY_ATTRIBUTE_READONLY);
+	}
+
+	context->Exit();
+#else
+	UNUSED_PARAMETER(context);
+	UNUSED_PARAMETER(memory);
+#endif
+}
+
+static CefRefPtr<CefV8Value> CreateArrayBuffer(CefRefPtr<CefBinaryValue> binary)
+{
+	size_t size = binary->GetSize();
+	if (size > MAX_BINARY_VALUE_SIZE)
+		return CefV8Value::CreateNull();
+
+#if CHROME_VERSION_BUILD >= 6367
+	return CefV8Value::CreateArrayBufferWithCopy(const_cast<void *>(binary->GetRawData()), size);
+#else
+	void *data = malloc(size ? size : 1);
+	if (!data)
+		return CefV8Value::CreateNull();
+	binary->GetData(data, size, 0);
+	return CefV8Value::CreateArrayBuffer(data, size, new FreeBufferCallback());
+#endif
+}
+
 CefRefPtr<CefV8Value> CefValueToCefV8Value(CefRefPtr<CefValue> value)
 {
 	CefRefPtr<CefV8Value> result;
@@ -174,7 +458,7 @@ CefRefPtr<CefV8Value> CefValueToCefV8Value(CefRefPtr<CefValue> value)
 		result = CefV8Value::CreateString(value->GetString());
 		break;
 	case VTYPE_BINARY:
-		result = CefV8Value::CreateNull();
+		result = CreateArrayBuffer(value->GetBinary());
 		break;
 	case VTYPE_DICTIONARY: {
 		result = CefV8Value::CreateObject(nullptr, nullptr);
@@ -224,102 +508,317 @@ bool BrowserApp::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefRefP
 		ExecuteJSFunction(browser, "onActiveChange", arguments);
 
 	} else if (message->GetName() == "DispatchJSEvent") {
-		nlohmann::json payloadJson = nlohmann::json::parse(args->GetString(1).ToString(), nullptr, false);
-
-		nlohmann::json wrapperJson;
-		if (args->GetSize() > 1)
-			wrapperJson["detail"] = payloadJson;
-		std::string wrapperJsonString = wrapperJson.dump();
-		std::string script;
-
-		script += "new CustomEvent('";
-		script += args->GetString(0).ToString();
-		script += "', ";
-		script += wrapperJsonString;
-		script += ");";
-
-		std::vector<CefString> names;
-		browser->GetFrameNames(names);
-		for (auto &name : names) {
-			CefRefPtr<CefFrame> frame =
-#if CHROME_VERSION_BUILD >= 6261
-				browser->GetFrameByName(name);
-#else
-				browser->GetFrame(name);
-#endif
-			CefRefPtr<CefV8Context> context = frame->GetV8Context();
+		auto it = frameContexts.find(browser->GetIdentifier());
+		if (it == frameContexts.end())
+			return true;
+
+		/* The browser process already validated JSON payloads, binary
+		 * ones become an ArrayBuffer in every frame */
+		CefString eventName = args->GetString(0);
+		CefRefPtr<CefBinaryValue> binary = args->GetType(1) == VTYPE_BINARY ? args->GetBinary(1) : nullptr;
+		CefString payload = args->GetType(1) == VTYPE_STRING ? args->GetString(1) : CefString("null");
+
+		/* Copied, event listeners can add or remove frames */
+		std::vector<FrameContext> frames = it->second;
+		for (const FrameContext &frameContext : frames) {
+			CefRefPtr<CefV8Context> context = frameContext.context;
+			if (!frameContext.dispatchEvent || !context->IsValid() || !WantsEvents(browser, frameContext))
+				continue;
 
 			context->Enter();
 
-			CefRefPtr<CefV8Value> globalObj = context->GetGlobal();
-
-			CefRefPtr<CefV8Value> returnValue;
-			CefRefPtr<CefV8Exception> exception;
-
-			/* Create the CustomEvent object
-			* We have to use eval to invoke the new operator */
-			context->Eval(script, browser->GetMainFrame()->GetURL(), 0, returnValue, exception);
-
 			CefV8ValueList arguments;
-			arguments.push_back(returnValue);
+			arguments.push_back(CefV8Value::CreateString(eventName));
+			if (binary) {
+				arguments.push_back(CreateArrayBuffer(binary));
+				arguments.push_back(CefV8Value::CreateBool(true));
+			} else {
+				arguments.push_back(CefV8Value::CreateString(payload));
+			}
 
-			CefRefPtr<CefV8Value> dispatchEvent = globalObj->GetValue("dispatchEvent");
-			dispatchEvent->ExecuteFunction(nullptr, arguments);
+			frameContext.dispatchEvent->ExecuteFunction(nullptr, arguments);
 
 			context->Exit();
 		}
 
-	} else if (message->GetName() == "executeCallback") {
+	} else if (message->GetName() == "ControlLevel") {
+		controlLevels[browser->GetIdentifier()] = (ControlLevel)args->GetInt(0);
+
+	} else if (message->GetName() == "SharedChannel") {
+		const std::string name = args->GetString(0).ToString();
+		const size_t size = (size_t)args->GetInt(1);
+
+		std::shared_ptr<SharedMemory> &memory = sharedChannels[browser->GetIdentifier()];
+		if (!memory || memory->Name() != name) {
+			auto channel = std::make_shared<SharedMemory>();
+			if (size < sizeof(SharedChannelHeader) || !channel->Open(name, size) ||
+			    ((SharedChannelHeader *)channel->Data())->magic != SHARED_CHANNEL_MAGIC) {
+				sharedChannels.erase(browser->GetIdentifier());
+				return true;
+			}
+			memory = channel;
+		}
+
+		ExposeSharedChannel(browser->GetMainFrame()->GetV8Context(), memory);
+
+	} else if (message->GetName() == "StateSnapshot") {
+		StateSnapshot &snapshot = stateSnapshots[browser->GetIdentifier()];
+		const int version = args->GetInt(0);
+		if (version <= snapshot.version)
+			return true;
+
+		nlohmann::json json = nlohmann::json::parse(args->GetString(1).ToString(), nullptr, false);
+		if (!json.is_object())
+			return true;
+
+		snapshot.version = version;
+		snapshot.values.clear();
+		for (auto &item : json.items())
+			snapshot.values[item.key()] = item.value().dump();
+
+	} else if (message->GetName() == "MemoryReport") {
+		/* The browser process reads the resident size of this process
+		 * itself, V8 heaps are only known in here */
+		double heap = 0.0;
 		CefRefPtr<CefV8Context> context = browser->GetMainFrame()->GetV8Context();
+		CefRefPtr<CefV8Value> retval;
+		CefRefPtr<CefV8Exception> exception;
+		if (context && context->IsValid() &&
+		    context->Eval("performance.memory ? performance.memory.usedJSHeapSize : 0", CefString(), 0, retval,
+				  exception) &&
+		    retval->IsDouble())
+			heap = retval->GetDoubleValue();
+
+		CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("MemoryReport");
+		CefRefPtr<CefListValue> reply = msg->GetArgumentList();
+#ifdef _WIN32
+		reply->SetInt(0, (int)GetCurrentProcessId());
+#else
+		reply->SetInt(0, (int)getpid());
+#endif
+		reply->SetDouble(1, heap);
+		SendBrowserProcessMessage(browser, PID_BROWSER, msg);
 
-		context->Enter();
+	} else if (message->GetName() == "executeCallback") {
+		/* Results are JSON, unless they hold binary values */
+		CefRefPtr<CefValue> result = args->GetValue(1);
+		if (result->GetType() == VTYPE_STRING)
+			result = CefParseJSON(result->GetString(), {});
+		ExecuteCallback(args->GetInt(0), result);
 
-		CefRefPtr<CefListValue> arguments = message->GetArgumentList();
-		int callbackID = arguments->GetInt(0);
-		CefString jsonString = arguments->GetString(1);
+	} else {
+		return false;
+	}
 
-		CefRefPtr<CefValue> json = CefParseJSON(arguments->GetString(1).ToString(), {});
+	return true;
+}
 
-		CefRefPtr<CefV8Value> callback = callbackMap[callbackID];
-		CefV8ValueList args;
+void BrowserApp::ExecuteCallback(int callbackID, CefRefPtr<CefValue> result)
+{
+	PendingCallback pending;
+	if (!callbackMap.Take(callbackID, pending) || !pending.context->IsValid())
+		return;
 
-		CefRefPtr<CefV8Value> retval = CefValueToCefV8Value(json);
+	CefRefPtr<CefV8Context> context = pending.context;
 
-		args.push_back(retval);
+	context->Enter();
 
-		if (callback)
-			callback->ExecuteFunction(nullptr, args);
+	CefV8ValueList args;
 
-		context->Exit();
+	CefRefPtr<CefV8Value> retval = result ? CefValueToCefV8Value(result) : CefV8Value::CreateNull();
 
-		callbackMap.erase(callbackID);
+	args.push_back(retval);
 
-	} else {
+	pending.callback->ExecuteFunction(nullptr, args);
+
+	context->Exit();
+}
+
+class RendererTask : public CefTask {
+public:
+	std::function<void()> task;
+
+	inline RendererTask(std::function<void()> task_) : task(task_) {}
+	virtual void Execute() override { task(); }
+
+	IMPLEMENT_REFCOUNTING(RendererTask);
+};
+
+bool BrowserApp::AnswerFromSnapshot(CefRefPtr<CefBrowser> browser, const std::string &name,
+				    CefRefPtr<CefV8Value> callback)
+{
+	auto snapshot = stateSnapshots.find(browser->GetIdentifier());
+	if (snapshot == stateSnapshots.end())
+		return false;
+
+	auto value = snapshot->second.values.find(name);
+	if (value == snapshot->second.values.end())
 		return false;
-	}
 
+	ResolveCallback(callback, value->second);
 	return true;
 }
 
+void BrowserApp::ResolveCallback(CefRefPtr<CefV8Value> callback, const std::string &result)
+{
+	/* Still called asynchronously, like an answer from the browser
+	 * process would be */
+	int id = AddCallback(callback);
+	if (!id)
+		return;
+
+	CefRefPtr<BrowserApp> self = this;
+	CefPostTask(TID_RENDERER, new RendererTask([self, id, result]() {
+			    self->ExecuteCallback(id, CefParseJSON(result, {}));
+		    }));
+}
+
+bool BrowserApp::IsAllowed(CefRefPtr<CefBrowser> browser, const std::string &name)
+{
+	/* Browsers created without a control level (panels) leave the check
+	 * to the browser process */
+	auto level = controlLevels.find(browser->GetIdentifier());
+	if (level == controlLevels.end())
+		return true;
+
+	ControlLevel required;
+	return GetFunctionControlLevel(name, required) && level->second >= required;
+}
+
 bool IsValidFunction(std::string function)
 {
-	std::vector<std::string>::iterator iterator;
-	iterator = std::find(exposedFunctions.begin(), exposedFunctions.end(), function);
-	return iterator != exposedFunctions.end();
+	ControlLevel level;
+	return GetFunctionControlLevel(function, level);
+}
+
+static void SetListArgument(CefRefPtr<CefListValue> args, size_t pos, CefRefPtr<CefV8Value> value)
+{
+	if (value->IsString())
+		args->SetString(pos, value->GetStringValue());
+	else if (value->IsInt())
+		args->SetInt(pos, value->GetIntValue());
+	else if (value->IsBool())
+		args->SetBool(pos, value->GetBoolValue());
+	else if (value->IsDouble())
+		args->SetDouble(pos, value->GetDoubleValue());
+#if CHROME_VERSION_BUILD >= 6367
+	else if (value->IsArrayBuffer() && value->GetArrayBufferByteLength() <= MAX_BINARY_VALUE_SIZE)
+		args->SetBinary(pos,
+				CefBinaryValue::Create(value->GetArrayBufferData(), value->GetArrayBufferByteLength()));
+#endif
+}
+
+static uint64_t GetTimeMs()
+{
+	using namespace std::chrono;
+	return (uint64_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+int BrowserApp::AddCallback(CefRefPtr<CefV8Value> callback)
+{
+	/* 0 means no callback, the browser process won't answer */
+	if (!callback)
+		return 0;
+
+	uint64_t now = GetTimeMs();
+	if (now >= nextCallbackExpiry) {
+		callbackMap.Expire(now);
+		nextCallbackExpiry = now + 1000;
+	}
+
+	/* Wraps around within the positive int range, 0 is skipped */
+	callbackId = (callbackId + 1) & INT32_MAX;
+	if (!callbackId)
+		callbackId = 1;
+
+	int id = (int)callbackId;
+	callbackMap.Insert(id, {callback, CefV8Context::GetCurrentContext()}, now + CALLBACK_TIMEOUT_MS);
+	return id;
 }
 
 bool BrowserApp::Execute(const CefString &name, CefRefPtr<CefV8Value>, const CefV8ValueList &arguments,
-			 CefRefPtr<CefV8Value> &, CefString &)
+			 CefRefPtr<CefV8Value> &retval, CefString &)
 {
-	if (IsValidFunction(name.ToString())) {
-		if (arguments.size() >= 1 && arguments[0]->IsFunction()) {
-			callbackId++;
-			callbackMap[callbackId] = arguments[0];
+	if (name == "subscribe") {
+		Subscribe(CefV8Context::GetCurrentContext(), arguments);
+
+	} else if (name == "getDiagnostics") {
+		retval = CefV8Value::CreateObject(nullptr, nullptr);
+		retval->SetValue("pendingCallbacks", CefV8Value::CreateUInt((uint32_t)callbackMap.Size()),
+				 V8_PROPERTY_ATTRIBUTE_NONE);
+		retval->SetValue("maxPendingCallbacks", CefV8Value::CreateUInt((uint32_t)callbackMap.Capacity()),
+				 V8_PROPERTY_ATTRIBUTE_NONE);
+
+	} else if (name == "readSharedChannel") {
+		CefRefPtr<CefBrowser> browser = CefV8Context::GetCurrentContext()->GetBrowser();
+		auto channel = sharedChannels.find(browser->GetIdentifier());
+		if (channel == sharedChannels.end())
+			retval = CefV8Value::CreateNull();
+		else
+			retval = CreateArrayBufferCopy(channel->second->Data(), channel->second->Size());
+
+	} else if (name == "batch") {
+		/* obsstudio.batch([{fn, args}, ...], callback) */
+		if (arguments.size() < 1 || !arguments[0]->IsArray())
+			return false;
+
+		CefRefPtr<CefListValue> calls = CefListValue::Create();
+		CefRefPtr<CefV8Value> list = arguments[0];
+
+		for (int i = 0; i < list->GetArrayLength(); i++) {
+			CefRefPtr<CefV8Value> entry = list->GetValue(i);
+			CefRefPtr<CefDictionaryValue> call = CefDictionaryValue::Create();
+			CefRefPtr<CefListValue> callArgs = CefListValue::Create();
+
+			CefRefPtr<CefV8Value> fn = entry->IsObject() ? entry->GetValue("fn") : nullptr;
+			call->SetString("fn", fn && fn->IsString() ? fn->GetStringValue() : CefString());
+
+			/* Same layout as a single call, slot 0 is the callback id */
+			callArgs->SetInt(0, 0);
+
+			CefRefPtr<CefV8Value> fnArgs = entry->IsObject() ? entry->GetValue("args") : nullptr;
+			if (fnArgs && fnArgs->IsArray()) {
+				for (int a = 0; a < fnArgs->GetArrayLength(); a++)
+					SetListArgument(callArgs, (size_t)a + 1, fnArgs->GetValue(a));
+			}
+
+			call->SetList("args", callArgs);
+			calls->SetDictionary(i, call);
 		}
 
+		CefRefPtr<CefV8Value> callback =
+			arguments.size() >= 2 && arguments[1]->IsFunction() ? arguments[1] : nullptr;
+
+		CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("batch");
+		CefRefPtr<CefListValue> args = msg->GetArgumentList();
+		args->SetInt(0, AddCallback(callback));
+		args->SetList(1, calls);
+
+		CefRefPtr<CefBrowser> browser = CefV8Context::GetCurrentContext()->GetBrowser();
+		InvalidateSnapshot(browser);
+		SendBrowserProcessMessage(browser, PID_BROWSER, msg);
+
+	} else if (IsValidFunction(name.ToString())) {
+		CefRefPtr<CefV8Value> callback =
+			arguments.size() >= 1 && arguments[0]->IsFunction() ? arguments[0] : nullptr;
+
+		CefRefPtr<CefBrowser> browser = CefV8Context::GetCurrentContext()->GetBrowser();
+		if (!IsAllowed(browser, name.ToString())) {
+			/* Same answer the browser process gives */
+			ResolveCallback(callback, "null");
+			return true;
+		}
+
+		if (AnswerFromSnapshot(browser, name.ToString(), callback))
+			return true;
+
+		/* Anything not in the snapshot may change the state, read
+		 * calls go to the browser process until the next snapshot */
+		InvalidateSnapshot(browser);
+
 		CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create(name);
 		CefRefPtr<CefListValue> args = msg->GetArgumentList();
-		args->SetInt(0, callbackId);
+		args->SetInt(0, AddCallback(callback));
 
 		/* Pass on arguments */
 		for (u_long l = 0; l < arguments.size(); l++) {
@@ -329,17 +828,9 @@ bool BrowserApp::Execute(const CefString &name, CefRefPtr<CefV8Value>, const Cef
 			else
 				pos = l + 1;
 
-			if (arguments[l]->IsString())
-				args->SetString(pos, arguments[l]->GetStringValue());
-			else if (arguments[l]->IsInt())
-				args->SetInt(pos, arguments[l]->GetIntValue());
-			else if (arguments[l]->IsBool())
-				args->SetBool(pos, arguments[l]->GetBoolValue());
-			else if (arguments[l]->IsDouble())
-				args->SetDouble(pos, arguments[l]->GetDoubleValue());
+			SetListArgument(args, pos, arguments[l]);
 		}
 
-		CefRefPtr<CefBrowser> browser = CefV8Context::GetCurrentContext()->GetBrowser();
 		SendBrowserProcessMessage(browser, PID_BROWSER, msg);
 
 	} else {
@@ -350,32 +841,69 @@ bool BrowserApp::Execute(const CefString &name, CefRefPtr<CefV8Value>, const Cef
 	return true;
 }
 
+bool BrowserApp::Get(const CefString &name, const CefRefPtr<CefV8Value> object, CefRefPtr<CefV8Value> &retval,
+		     CefString &)
+{
+	CefRefPtr<CefBaseRefCounted> userData = object->GetUserData();
+	if (!userData)
+		return false;
+
+	FunctionCache *cache = static_cast<FunctionCache *>(userData.get());
+	CefRefPtr<CefV8Value> &func = cache->functions[name.ToString()];
+	if (!func)
+		func = CefV8Value::CreateFunction(name, this);
+
+	retval = func;
+	return true;
+}
+
+bool BrowserApp::Set(const CefString &name, const CefRefPtr<CefV8Value> object, const CefRefPtr<CefV8Value> value,
+		     CefString &)
+{
+	/* Lets pages replace functions, as they could before they were
+	 * created lazily */
+	CefRefPtr<CefBaseRefCounted> userData = object->GetUserData();
+	if (!userData)
+		return false;
+
+	static_cast<FunctionCache *>(userData.get())->functions[name.ToString()] = value;
+	return true;
+}
+
 #ifdef ENABLE_BROWSER_QT_LOOP
 Q_DECLARE_METATYPE(MessageTask);
 MessageObject messageObject;
 
 void QueueBrowserTask(CefRefPtr<CefBrowser> browser, BrowserFunc func)
 {
-	std::lock_guard<std::mutex> lock(messageObject.browserTaskMutex);
-	messageObject.browserTasks.emplace_back(browser, func);
+	{
+		std::lock_guard<std::mutex> lock(messageObject.browserTaskMutex);
+		messageObject.browserTasks.emplace_back(browser, func);
+
+		/* Only the first task of a burst schedules a drain */
+		if (messageObject.browserTasksScheduled)
+			return;
+		messageObject.browserTasksScheduled = true;
+	}
 
-	QMetaObject::invokeMethod(&messageObject, "ExecuteNextBrowserTask", Qt::QueuedConnection);
+	messageObject.browserTaskWakeups++;
+	QMetaObject::invokeMethod(&messageObject, "ExecuteBrowserTasks", Qt::QueuedConnection);
 }
 
-bool MessageObject::ExecuteNextBrowserTask()
+bool MessageObject::ExecuteBrowserTasks()
 {
-	Task nextTask;
+	std::deque<Task> tasks;
 	{
 		std::lock_guard<std::mutex> lock(browserTaskMutex);
-		if (!browserTasks.size())
-			return false;
-
-		nextTask = browserTasks[0];
-		browserTasks.pop_front();
+		tasks.swap(browserTasks);
+		browserTasksScheduled = false;
 	}
 
-	nextTask.func(nextTask.browser);
-	return true;
+	for (Task &task : tasks)
+		task.func(task.browser);
+
+	browserTaskCount += tasks.size();
+	return !tasks.empty();
 }
 
 void MessageObject::ExecuteTask(MessageTask task)
@@ -383,22 +911,116 @@ void MessageObject::ExecuteTask(MessageTask task)
 	task();
 }
 
-void MessageObject::DoCefMessageLoop(int ms)
+#define FRAME_TIMER_INTERVAL 33
+
+/* Added to the delays CEF asks for, as it always was: Qt timers may fire a
+ * little early, and a pump that runs before the work is due has nothing to
+ * do, so CEF would have to ask again */
+#define PUMP_DELAY_SLACK_MS 2
+
+/* Upper bounds of the pump duration histogram buckets, the last one takes
+ * everything above */
+static const int64_t pump_bucket_us[] = {100, 500, 1000, 2000, 5000, 10000, 20000};
+
+/* Can be called from any thread. A request that is due no earlier than the
+ * one already pending is merged into it. */
+void MessageObject::SchedulePump(int64_t delay_ms)
+{
+	Clock::time_point deadline = Clock::now();
+	if (delay_ms)
+		deadline += std::chrono::milliseconds(delay_ms + PUMP_DELAY_SLACK_MS);
+
+	pumpRequests++;
+	{
+		std::lock_guard<std::mutex> lock(pumpMutex);
+		if (pumpPending && pumpDeadline <= deadline)
+			return;
+
+		pumpPending = true;
+		pumpDeadline = deadline;
+
+		/* The queued ArmPump() will pick up the new deadline */
+		if (pumpArming)
+			return;
+		pumpArming = true;
+	}
+
+	QMetaObject::invokeMethod(this, "ArmPump", Qt::QueuedConnection);
+}
+
+void MessageObject::ArmPump()
 {
-	if (ms)
-		QTimer::singleShot((int)ms + 2, []() { CefDoMessageLoopWork(); });
-	else
-		CefDoMessageLoopWork();
+	Clock::time_point deadline;
+	{
+		std::lock_guard<std::mutex> lock(pumpMutex);
+		pumpArming = false;
+		if (!pumpPending)
+			return;
+		deadline = pumpDeadline;
+	}
+
+	if (!pumpTimer) {
+		pumpTimer = new QTimer(this);
+		pumpTimer->setSingleShot(true);
+		connect(pumpTimer, &QTimer::timeout, this, &MessageObject::RunPump);
+	}
+
+	auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+	pumpTimer->start(std::max((int)remaining.count(), 0));
 }
 
-void MessageObject::Process()
+void MessageObject::RunPump()
 {
+	{
+		std::lock_guard<std::mutex> lock(pumpMutex);
+		pumpPending = false;
+	}
+	if (pumpTimer)
+		pumpTimer->stop();
+
+	Clock::time_point start = Clock::now();
 	CefDoMessageLoopWork();
+	lastPump = Clock::now();
+
+	int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(lastPump - start).count();
+	size_t bucket = 0;
+	while (bucket < std::size(pump_bucket_us) && us > pump_bucket_us[bucket])
+		bucket++;
+	pumpDurations[bucket]++;
+
+	if (!pumpCount++)
+		firstPump = start;
+}
+
+/* Fallback in case CEF stops asking for work, only pumps if nothing else
+ * did for a whole interval */
+void MessageObject::Process()
+{
+	if (Clock::now() - lastPump >= std::chrono::milliseconds(FRAME_TIMER_INTERVAL))
+		RunPump();
+}
+
+void MessageObject::LogPumpStats()
+{
+	if (!pumpCount)
+		return;
+
+	double seconds = std::chrono::duration<double>(lastPump - firstPump).count();
+	blog(LOG_DEBUG, "[obs-browser]: %" PRIu64 " message loop pumps for %" PRIu64 " requests, %.1f per second",
+	     pumpCount, pumpRequests.load(), seconds > 0.0 ? (double)pumpCount / seconds : 0.0);
+
+	for (size_t i = 0; i < std::size(pumpDurations); i++) {
+		if (i < std::size(pump_bucket_us))
+			blog(LOG_DEBUG, "[obs-browser]:   <= %6" PRId64 " us: %" PRIu64, pump_bucket_us[i],
+			     pumpDurations[i]);
+		else
+			blog(LOG_DEBUG, "[obs-browser]:   longer:    %" PRIu64, pumpDurations[i]);
+	}
 }
 
 void ProcessCef()
 {
-	QMetaObject::invokeMethod(&messageObject, "DoCefMessageLoop", Qt::QueuedConnection, Q_ARG(int, (int)0));
+	messageObject.SchedulePump(0);
 }
 
 #define MAX_DELAY (1000 / 30)
@@ -417,9 +1039,9 @@ void BrowserApp::OnScheduleMessagePumpWork(int64_t delay_ms)
 	if (!frameTimer.isActive()) {
 		QObject::connect(&frameTimer, &QTimer::timeout, &messageObject, &MessageObject::Process);
 		frameTimer.setSingleShot(false);
-		frameTimer.start(33);
+		frameTimer.start(FRAME_TIMER_INTERVAL);
 	}
 
-	QMetaObject::invokeMethod(&messageObject, "DoCefMessageLoop", Qt::QueuedConnection, Q_ARG(int, (int)delay_ms));
+	messageObject.SchedulePump(delay_ms);
 }
 #endif
@@ -20,14 +20,39 @@
 
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <functional>
 #include "cef-headers.hpp"
+#include "browser-callback-table.hpp"
+#include "shared-memory.hpp"
+#include <memory>
 
 typedef std::function<void(CefRefPtr<CefBrowser>)> BrowserFunc;
 
+enum class ControlLevel : int {
+	None,
+	ReadObs,
+	ReadUser,
+	Basic,
+	Advanced,
+	All,
+};
+inline constexpr ControlLevel DEFAULT_CONTROL_LEVEL = ControlLevel::ReadObs;
+
+/* Largest binary value (ArrayBuffer) passed between OBS and a page, bigger
+ * ones are dropped. Chromium refuses IPC messages over 128 MiB. */
+inline constexpr size_t MAX_BINARY_VALUE_SIZE = 64 * 1024 * 1024;
+
+/* Looks up a function exposed on window.obsstudio, and the control level
+ * a page needs to call it */
+bool GetFunctionControlLevel(const std::string &function, ControlLevel &level);
+
 #ifdef ENABLE_BROWSER_QT_LOOP
 #include <QObject>
 #include <QTimer>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <deque>
 
@@ -48,26 +73,114 @@ class MessageObject : public QObject {
 
 	std::mutex browserTaskMutex;
 	std::deque<Task> browserTasks;
+	bool browserTasksScheduled = false;
+
+	/* Message loop work requested by CEF and by rendering sources is
+	 * merged, one pump runs for the earliest deadline requested */
+	typedef std::chrono::steady_clock Clock;
+	std::mutex pumpMutex;
+	bool pumpPending = false;
+	bool pumpArming = false;
+	Clock::time_point pumpDeadline;
+
+	/* Qt main thread only. The timer is created by the first ArmPump(),
+	 * this object exists before QApplication does. */
+	QTimer *pumpTimer = nullptr;
+	Clock::time_point firstPump;
+	Clock::time_point lastPump;
+	uint64_t pumpCount = 0;
+	uint64_t pumpDurations[8] = {};
+
+public:
+	/* Drains scheduled on the Qt event queue, and tasks they ran */
+	std::atomic<uint32_t> browserTaskWakeups = 0;
+	std::atomic<uint64_t> browserTaskCount = 0;
+	std::atomic<uint64_t> pumpRequests = 0;
+
+	void SchedulePump(int64_t delay_ms);
+	void LogPumpStats();
 
 public slots:
-	bool ExecuteNextBrowserTask();
+	bool ExecuteBrowserTasks();
 	void ExecuteTask(MessageTask task);
-	void DoCefMessageLoop(int ms);
+	void DrainCEFTasks();
+	void ArmPump();
+	void RunPump();
 	void Process();
 };
 
 extern void QueueBrowserTask(CefRefPtr<CefBrowser> browser, BrowserFunc func);
 #endif
 
-class BrowserApp : public CefApp, public CefRenderProcessHandler, public CefBrowserProcessHandler, public CefV8Handler {
+class BrowserApp : public CefApp,
+		   public CefRenderProcessHandler,
+		   public CefBrowserProcessHandler,
+		   public CefV8Handler,
+		   public CefV8Accessor {
+
+	/* Callbacks the browser process never answered are dropped after
+	 * CALLBACK_TIMEOUT_MS, or when more than MAX_PENDING_CALLBACKS are
+	 * waiting */
+	static constexpr size_t MAX_PENDING_CALLBACKS = 1024;
+	static constexpr uint64_t CALLBACK_TIMEOUT_MS = 60000;
 
 	void ExecuteJSFunction(CefRefPtr<CefBrowser> browser, const char *functionName, CefV8ValueList arguments);
 
-	typedef std::map<int, CefRefPtr<CefV8Value>> CallbackMap;
+	struct PendingCallback {
+		CefRefPtr<CefV8Value> callback;
+		CefRefPtr<CefV8Context> context;
+	};
+	typedef CallbackTable<PendingCallback> CallbackMap;
+
+	/* V8 context of every frame of a browser, with the native event
+	 * dispatcher installed in it. Sub-frames only receive events once the
+	 * page subscribed to some if they called obsstudio.subscribe() too. */
+	struct FrameContext {
+		CefRefPtr<CefV8Context> context;
+		CefRefPtr<CefV8Value> dispatchEvent;
+		bool main = false;
+		bool subscribed = false;
+	};
+	typedef std::unordered_map<int, std::vector<FrameContext>> FrameContextMap;
+
+	/* Events the page subscribed to */
+	struct EventSubscriptions {
+		std::unordered_set<std::string> names;
+	};
+	typedef std::unordered_map<int, EventSubscriptions> SubscriptionMap;
+
+	/* Latest state pushed by the browser process, read-only calls are
+	 * answered from it without a round trip */
+	struct StateSnapshot {
+		int version = 0;
+		std::unordered_map<std::string, std::string> values;
+	};
+	typedef std::unordered_map<int, StateSnapshot> StateSnapshotMap;
+
+	/* Shared memory channels of each browser, see browser-shared-channel.hpp */
+	typedef std::unordered_map<int, std::shared_ptr<SharedMemory>> SharedChannelMap;
+
+	void ExposeSharedChannel(CefRefPtr<CefV8Context> context, std::shared_ptr<SharedMemory> memory);
+
+	int AddCallback(CefRefPtr<CefV8Value> callback);
+	void ExecuteCallback(int callbackID, CefRefPtr<CefValue> result);
+	bool AnswerFromSnapshot(CefRefPtr<CefBrowser> browser, const std::string &name, CefRefPtr<CefV8Value> callback);
+	void InvalidateSnapshot(CefRefPtr<CefBrowser> browser);
+	void ResolveCallback(CefRefPtr<CefV8Value> callback, const std::string &result);
+	bool IsAllowed(CefRefPtr<CefBrowser> browser, const std::string &name);
+	void Subscribe(CefRefPtr<CefV8Context> context, const CefV8ValueList &arguments);
+	bool WantsEvents(CefRefPtr<CefBrowser> browser, const FrameContext &frame);
+	FrameContext *GetFrameContext(CefRefPtr<CefV8Context> context);
 
 	bool shared_texture_available;
-	CallbackMap callbackMap;
-	int callbackId;
+	CallbackMap callbackMap{MAX_PENDING_CALLBACKS};
+	std::unordered_map<int, ControlLevel> controlLevels;
+	FrameContextMap frameContexts;
+	SubscriptionMap subscriptions;
+	SharedChannelMap sharedChannels;
+	StateSnapshotMap stateSnapshots;
+	uint32_t callbackId = 0; /* last id handed out, ids are positive ints */
+	uint64_t nextCallbackExpiry = 0;
 #if !defined(__APPLE__) && !defined(_WIN32)
 	bool wayland;
 #endif
@@ -89,13 +202,21 @@ public:
 	virtual void OnRegisterCustomSchemes(CefRawPtr<CefSchemeRegistrar> registrar) override;
 	virtual void OnBeforeCommandLineProcessing(const CefString &process_type,
 						   CefRefPtr<CefCommandLine> command_line) override;
+	virtual void OnBrowserCreated(CefRefPtr<CefBrowser> browser, CefRefPtr<CefDictionaryValue> extra_info) override;
+	virtual void OnBrowserDestroyed(CefRefPtr<CefBrowser> browser) override;
 	virtual void OnContextCreated(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
 				      CefRefPtr<CefV8Context> context) override;
+	virtual void OnContextReleased(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
+				       CefRefPtr<CefV8Context> context) override;
 	virtual bool OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
 					      CefProcessId source_process,
 					      CefRefPtr<CefProcessMessage> message) override;
 	virtual bool Execute(const CefString &name, CefRefPtr<CefV8Value> object, const CefV8ValueList &arguments,
 			     CefRefPtr<CefV8Value> &retval, CefString &exception) override;
+	virtual bool Get(const CefString &name, const CefRefPtr<CefV8Value> object, CefRefPtr<CefV8Value> &retval,
+			 CefString &exception) override;
+	virtual bool Set(const CefString &name, const CefRefPtr<CefV8Value> object, const CefRefPtr<CefV8Value> value,
+			 CefString &exception) override;
 
 #ifdef ENABLE_BROWSER_QT_LOOP
 #if CHROME_VERSION_BUILD < 5938
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/* Fixed-size table of pending JS callbacks keyed by callback id.
+ *
+ * Entries live in a preallocated slab, and are found through an open
+ * addressing (linear probing) index twice the size of the slab. The table
+ * never grows: when it is full, the entry closest to expiring is evicted to
+ * make room for the new one. */
+template<typename T> class CallbackTable {
+	static constexpr int EMPTY = -1;
+
+	struct Slot {
+		int id = 0;
+		bool used = false;
+		uint64_t expires = 0;
+		T value = {};
+		int next_free = EMPTY;
+	};
+
+	std::vector<Slot> slab;
+	std::vector<int> index;
+	size_t mask;
+	size_t count = 0;
+	int free_list = EMPTY;
+
+	inline size_t Home(int id) const { return ((uint32_t)id * 2654435761u) & mask; }
+
+	size_t Find(int id) const
+	{
+		for (size_t i = Home(id);; i = (i + 1) & mask) {
+			int slot = index[i];
+			if (slot == EMPTY || slab[slot].id == id)
+				return i;
+		}
+	}
+
+	void RemoveAt(size_t pos)
+	{
+		int slot = index[pos];
+		slab[slot].used = false;
+		slab[slot].value = {};
+		slab[slot].next_free = free_list;
+		free_list = slot;
+		count--;
+
+		/* Backward shift deletion, keeps probe sequences intact
+		 * without tombstones */
+		size_t hole = pos;
+		index[hole] = EMPTY;
+		for (size_t i = (hole + 1) & mask; index[i] != EMPTY; i = (i + 1) & mask) {
+			size_t home = Home(slab[index[i]].id);
+			bool movable = (hole <= i) ? (home <= hole || home > i) : (home <= hole && home > i);
+			if (movable) {
+				index[hole] = index[i];
+				index[i] = EMPTY;
+				hole = i;
+			}
+		}
+	}
+
+public:
+	explicit CallbackTable(size_t capacity)
+	{
+		size_t buckets = 2;
+		while (buckets < capacity * 2)
+			buckets <<= 1;
+
+		slab.resize(capacity);
+		index.assign(buckets, EMPTY);
+		mask = buckets - 1;
+
+		for (size_t i = capacity; i > 0; i--) {
+			slab[i - 1].next_free = free_list;
+			free_list = (int)(i - 1);
+		}
+	}
+
+	inline size_t Size() const { return count; }
+	inline size_t Capacity() const { return slab.size(); }
+
+	void Insert(int id, T value, uint64_t expires)
+	{
+		size_t pos = Find(id);
+		if (index[pos] != EMPTY) {
+			Slot &slot = slab[index[pos]];
+			slot.value = std::move(value);
+			slot.expires = expires;
+			return;
+		}
+
+		if (free_list == EMPTY) {
+			size_t oldest = 0;
+			for (size_t i = 1; i < slab.size(); i++) {
+				if (slab[i].expires < slab[oldest].expires)
+					oldest = i;
+			}
+			RemoveAt(Find(slab[oldest].id));
+			pos = Find(id);
+		}
+
+		int slot = free_list;
+		free_list = slab[slot].next_free;
+
+		slab[slot].id = id;
+		slab[slot].used = true;
+		slab[slot].expires = expires;
+		slab[slot].value = std::move(value);
+		index[pos] = slot;
+		count++;
+	}
+
+	bool Take(int id, T &value)
+	{
+		size_t pos = Find(id);
+		if (index[pos] == EMPTY)
+			return false;
+
+		value = std::move(slab[index[pos]].value);
+		RemoveAt(pos);
+		return true;
+	}
+
+	/* Removes every entry the predicate returns true for */
+	template<typename Pred> size_t RemoveIf(Pred pred)
+	{
+		size_t removed = 0;
+		for (Slot &slot : slab) {
+			if (slot.used && pred(slot.value, slot.expires)) {
+				RemoveAt(Find(slot.id));
+				removed++;
+			}
+		}
+		return removed;
+	}
+
+	size_t Expire(uint64_t now)
+	{
+		return RemoveIf([now](const T &, uint64_t expires) { return expires <= now; });
+	}
+};
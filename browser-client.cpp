@@ -18,11 +18,15 @@
 
 #include "browser-client.hpp"
 #include "obs-browser-source.hpp"
+#include "browser-task-queue.hpp"
 #include "base64/base64.hpp"
 #include <nlohmann/json.hpp>
 #include <obs-frontend-api.h>
 #include <obs.hpp>
 #include <util/platform.h>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <QApplication>
 #include <QThread>
 #include <QToolTip>
@@ -88,13 +92,18 @@ CefRefPtr<CefResourceRequestHandler> BrowserClient::GetResourceRequestHandler(Ce
 	return nullptr;
 }
 
-void BrowserClient::OnRenderProcessTerminated(CefRefPtr<CefBrowser>, TerminationStatus
+void BrowserClient::OnRenderProcessTerminated(CefRefPtr<CefBrowser> browser, TerminationStatus
 #if CHROME_VERSION_BUILD >= 6367
 					      ,
 					      int, const CefString &error_string
 #endif
 )
 {
+	if (!pool_rect.IsEmpty()) {
+		DropPooledBrowser(browser);
+		return;
+	}
+
 	if (!valid())
 		return;
 
@@ -111,6 +120,9 @@ void BrowserClient::OnRenderProcessTerminated(CefRefPtr<CefBrowser>, Termination
 
 	blog(LOG_ERROR, "[obs-browser: '%s'] Webpage has crashed unexpectedly! Reason: '%s'", sourceName,
 	     str_text.c_str());
+
+	if (bs && !bs->destroying)
+		bs->OnRendererCrashed(str_text);
 }
 
 CefResourceRequestHandler::ReturnValue BrowserClient::OnBeforeResourceLoad(CefRefPtr<CefBrowser>, CefRefPtr<CefFrame>,
@@ -132,6 +144,27 @@ bool BrowserClient::OnBeforePopup(CefRefPtr<CefBrowser>, CefRefPtr<CefFrame>,
 	return true;
 }
 
+extern void AddPooledBrowser(BrowserClient *client, CefRefPtr<CefBrowser> browser);
+extern void DropPooledBrowser(CefRefPtr<CefBrowser> browser);
+extern void SetPooledBrowserPid(CefRefPtr<CefBrowser> browser, int pid);
+
+void BrowserClient::OnAfterCreated(CefRefPtr<CefBrowser> browser)
+{
+	if (!pool_rect.IsEmpty())
+		AddPooledBrowser(this, browser);
+}
+
+void BrowserClient::OnBeforeClose(CefRefPtr<CefBrowser>)
+{
+	if (!released_time)
+		return;
+
+	/* Released browsers are closed in the background, keep track of how
+	 * long they linger */
+	double ms = (double)(os_gettime_ns() - released_time) / 1000000.0;
+	blog(LOG_DEBUG, "[obs-browser]: Browser closed %.1f ms after its source released it", ms);
+}
+
 void BrowserClient::OnBeforeContextMenu(CefRefPtr<CefBrowser>, CefRefPtr<CefFrame>, CefRefPtr<CefContextMenuParams>,
 					CefRefPtr<CefMenuModel> model)
 {
@@ -139,17 +172,11 @@ void BrowserClient::OnBeforeContextMenu(CefRefPtr<CefBrowser>, CefRefPtr<CefFram
 	model->Clear();
 }
 
-bool BrowserClient::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame>, CefProcessId,
-					     CefRefPtr<CefProcessMessage> message)
+static nlohmann::json RunFunction(const std::string &source_name, ControlLevel webpage_control_level,
+				  const std::string &name, CefRefPtr<CefListValue> input_args)
 {
-	const std::string &name = message->GetName();
-	CefRefPtr<CefListValue> input_args = message->GetArgumentList();
 	nlohmann::json json;
 
-	if (!valid()) {
-		return false;
-	}
-
 	// Fall-through switch, so that higher levels also have lower-level rights
 	switch (webpage_control_level) {
 	case ControlLevel::All:
@@ -182,10 +209,10 @@ bool BrowserClient::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefR
 			if (!source) {
 				blog(LOG_WARNING,
 				     "Browser source '%s' tried to switch to scene '%s' which doesn't exist",
-				     obs_source_get_name(bs->source), scene_name.c_str());
+				     source_name.c_str(), scene_name.c_str());
 			} else if (!obs_source_is_scene(source)) {
 				blog(LOG_WARNING, "Browser source '%s' tried to switch to '%s' which isn't a scene",
-				     obs_source_get_name(bs->source), scene_name.c_str());
+				     source_name.c_str(), scene_name.c_str());
 			} else {
 				obs_frontend_set_current_scene(source);
 			}
@@ -210,7 +237,7 @@ bool BrowserClient::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefR
 			else
 				blog(LOG_WARNING,
 				     "Browser source '%s' tried to change the current transition to '%s' which doesn't exist",
-				     obs_source_get_name(bs->source), transition_name.c_str());
+				     source_name.c_str(), transition_name.c_str());
 		}
 		[[fallthrough]];
 	case ControlLevel::Basic:
@@ -233,11 +260,11 @@ bool BrowserClient::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefR
 			OBSSourceAutoRelease current_scene = obs_frontend_get_current_scene();
 
 			if (!current_scene)
-				return false;
+				return nullptr;
 
 			const char *name = obs_source_get_name(current_scene);
 			if (!name)
-				return false;
+				return nullptr;
 
 			json = {{"name", name},
 				{"width", obs_source_get_width(current_scene)},
@@ -272,13 +299,183 @@ bool BrowserClient::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefR
 		}
 	}
 
+	return json;
+}
+
+extern bool QueueFrontendTask(std::function<void()> task);
+extern bool FrontendTasksPending();
+
+/* Read-only calls the renderer answers from its state snapshot */
+static const char *state_functions[] = {
+	"getControlLevel",
+	"getStatus",
+	"getCurrentScene",
+	"getScenes",
+	"getTransitions",
+	"getCurrentTransition",
+};
+
+/* Frontend state as of the last frontend event, with every field, so it can
+ * be shared by all sources whatever their control level */
+static std::shared_ptr<const nlohmann::json> state_cache;
+
+/* Queries the frontend, only called on the UI thread */
+std::shared_ptr<const nlohmann::json> UpdateStateCache()
+{
+	auto state = std::make_shared<nlohmann::json>(nlohmann::json::object());
+
+	for (const char *name : state_functions)
+		(*state)[name] = RunFunction(std::string(), ControlLevel::All, name, nullptr);
+
+	std::shared_ptr<const nlohmann::json> result = std::move(state);
+	std::atomic_store(&state_cache, result);
+	return result;
+}
+
+static bool GetCachedState(const std::shared_ptr<const nlohmann::json> &state, ControlLevel webpage_control_level,
+			   const std::string &name, nlohmann::json &result)
+{
+	ControlLevel required;
+	if (!GetFunctionControlLevel(name, required) || webpage_control_level < required)
+		return false;
+
+	if (name == "getControlLevel") {
+		result = (int)webpage_control_level;
+		return true;
+	}
+
+	if (!state)
+		return false;
+
+	auto value = state->find(name);
+	if (value == state->end())
+		return false;
+
+	result = *value;
+	return true;
+}
+
+std::string GetStateSnapshot(ControlLevel webpage_control_level)
+{
+	std::shared_ptr<const nlohmann::json> state = std::atomic_load(&state_cache);
+	if (!state)
+		state = UpdateStateCache();
+
+	nlohmann::json json = nlohmann::json::object();
+	for (const char *name : state_functions) {
+		nlohmann::json value;
+		if (GetCachedState(state, webpage_control_level, name, value))
+			json[name] = std::move(value);
+	}
+
+	return json.dump();
+}
+
+/* Runs every call of obsstudio.batch() and answers them all at once,
+ * reporting calls the page isn't allowed to make */
+static nlohmann::json RunBatch(const std::string &source_name, ControlLevel webpage_control_level,
+			       CefRefPtr<CefListValue> calls)
+{
+	nlohmann::json json = nlohmann::json::array();
+
+	for (size_t i = 0; calls && i < calls->GetSize(); i++) {
+		CefRefPtr<CefDictionaryValue> call = calls->GetDictionary(i);
+		const std::string fn = call ? call->GetString("fn").ToString() : std::string();
+		ControlLevel required;
+
+		if (!GetFunctionControlLevel(fn, required)) {
+			json.push_back({{"fn", fn}, {"error", "unknown function"}});
+		} else if (webpage_control_level < required) {
+			json.push_back({{"fn", fn}, {"error", "permission denied"}});
+		} else {
+			CefRefPtr<CefListValue> args = call->GetList("args");
+			nlohmann::json result = RunFunction(source_name, webpage_control_level, fn, args);
+			json.push_back({{"fn", fn}, {"result", result}});
+		}
+	}
+
+	return json;
+}
+
+static void SendCallbackResult(CefRefPtr<CefBrowser> browser, int callback_id, const std::string &result)
+{
 	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("executeCallback");
 
 	CefRefPtr<CefListValue> execute_args = msg->GetArgumentList();
-	execute_args->SetInt(0, input_args->GetInt(0));
-	execute_args->SetString(1, json.dump());
+	execute_args->SetInt(0, callback_id);
+	execute_args->SetString(1, result);
 
 	SendBrowserProcessMessage(browser, PID_RENDERER, msg);
+}
+
+bool BrowserClient::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame>, CefProcessId,
+					     CefRefPtr<CefProcessMessage> message)
+{
+	const std::string name = message->GetName();
+	CefRefPtr<CefListValue> input_args = message->GetArgumentList();
+
+	if (!pool_rect.IsEmpty() && name == "MemoryReport") {
+		SetPooledBrowserPid(browser, input_args->GetInt(0));
+		return true;
+	}
+
+	if (!valid()) {
+		return false;
+	}
+
+	if (name == "DocumentCreated") {
+		/* New document in the main frame, it starts out receiving
+		 * every event and needs the control level, shared channel and
+		 * current state. It may live in a new renderer process, which
+		 * only knows the level the browser was created with. */
+		SendControlLevel(browser, webpage_control_level);
+		bs->UpdateEventSubscriptions(true, nullptr);
+		bs->SendSharedChannel(browser);
+		bs->SendStateSnapshot(browser);
+		return true;
+	} else if (name == "Subscribe") {
+		bs->UpdateEventSubscriptions(false, input_args->GetList(0));
+		return true;
+	} else if (name == "MemoryReport") {
+		bs->UpdateMemoryReport(browser, input_args->GetInt(0), (uint64_t)input_args->GetDouble(1));
+		return true;
+	}
+
+	const int callback_id = input_args->GetInt(0);
+
+	/* Reads are answered right away when the state is known, unless
+	 * calls that may change it are still queued */
+	nlohmann::json json;
+	if (!FrontendTasksPending() &&
+	    GetCachedState(std::atomic_load(&state_cache), webpage_control_level, name, json)) {
+		if (callback_id)
+			SendCallbackResult(browser, callback_id, json.dump());
+		return true;
+	}
+
+	/* Everything else talks to the frontend on the UI thread. The queue
+	 * keeps calls in order, so commands apply in the order the page made
+	 * them, and reads queued behind them see their result. */
+	const std::string source_name = obs_source_get_name(bs->source);
+	const ControlLevel level = webpage_control_level;
+	CefRefPtr<CefListValue> args = input_args->Copy();
+
+	bool queued = QueueFrontendTask([=]() {
+		nlohmann::json result = name == "batch" ? RunBatch(source_name, level, args->GetList(1))
+							: RunFunction(source_name, level, name, args);
+
+		/* The page did not pass a callback */
+		if (!callback_id)
+			return;
+
+		std::string json = result.dump();
+		QueueCEFTask([browser, callback_id, json]() { SendCallbackResult(browser, callback_id, json); },
+			     TaskLane::Event);
+	});
+
+	if (!queued)
+		blog(LOG_WARNING, "[obs-browser]: Failed to queue '%s' call of browser source '%s'", name.c_str(),
+		     source_name.c_str());
 
 	return true;
 }
@@ -286,7 +483,10 @@ bool BrowserClient::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser, CefR
 void BrowserClient::GetViewRect(CefRefPtr<CefBrowser>, CefRect &rect)
 {
 	if (!valid()) {
-		rect.Set(0, 0, 16, 16);
+		if (pool_rect.IsEmpty())
+			rect.Set(0, 0, 16, 16);
+		else
+			rect = pool_rect;
 		return;
 	}
 
@@ -315,7 +515,7 @@ void BrowserClient::OnPaint(CefRefPtr<CefBrowser>, PaintElementType type, const
 	}
 #endif
 
-	if (!valid()) {
+	if (!valid() || bs->PaintHeld()) {
 		return;
 	}
 
@@ -381,7 +581,7 @@ void BrowserClient::OnAcceleratedPaint(CefRefPtr<CefBrowser>, PaintElementType t
 		return;
 	}
 
-	if (!valid()) {
+	if (!valid() || bs->PaintHeld()) {
 		return;
 	}
 
@@ -606,24 +806,49 @@ bool BrowserClient::GetAudioParameters(CefRefPtr<CefBrowser> browser, CefAudioPa
 	return true;
 }
 
-void BrowserClient::OnLoadEnd(CefRefPtr<CefBrowser>, CefRefPtr<CefFrame> frame, int)
+void BrowserClient::OnLoadEnd(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame, int)
 {
 	if (!valid()) {
 		return;
 	}
 
-	if (frame->IsMain() && bs->css.length()) {
-		std::string uriEncodedCSS = CefURIEncode(bs->css, false).ToString();
+	if (!frame->IsMain())
+		return;
 
-		std::string script;
-		script += "const obsCSS = document.createElement('style');";
-		script += "obsCSS.appendChild(document.createTextNode("
-			  "decodeURIComponent(\"" +
-			  uriEncodedCSS + "\")));";
-		script += "document.querySelector('head').appendChild(obsCSS);";
+	std::string css = bs->GetCSS();
+	if (css.length())
+		InjectCSS(frame, css);
+	bs->OnPageLoaded();
+	bs->ReleaseFrame(false);
+	bs->PreloadLoaded(browser);
+}
 
-		frame->ExecuteJavaScript(script, "", 0);
-	}
+/* Tells the renderer which calls it can reject without asking */
+void BrowserClient::SendControlLevel(CefRefPtr<CefBrowser> browser, ControlLevel level)
+{
+	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("ControlLevel");
+	msg->GetArgumentList()->SetInt(0, (int)level);
+	SendBrowserProcessMessage(browser, PID_RENDERER, msg);
+}
+
+/* Also used to replace the CSS of a loaded page, so the style element is
+ * reused if it's there already */
+void BrowserClient::InjectCSS(CefRefPtr<CefFrame> frame, const std::string &css)
+{
+	std::string uriEncodedCSS = CefURIEncode(css, false).ToString();
+
+	std::string script;
+	script += "(function (css) {";
+	script += "let obsCSS = document.getElementById('obs-browser-css');";
+	script += "if (!obsCSS) {";
+	script += "obsCSS = document.createElement('style');";
+	script += "obsCSS.id = 'obs-browser-css';";
+	script += "document.querySelector('head').appendChild(obsCSS);";
+	script += "}";
+	script += "obsCSS.textContent = css;";
+	script += "})(decodeURIComponent(\"" + uriEncodedCSS + "\"));";
+
+	frame->ExecuteJavaScript(script, "", 0);
 }
 
 bool BrowserClient::OnConsoleMessage(CefRefPtr<CefBrowser>, cef_log_severity_t level, const CefString &message,
@@ -53,6 +53,13 @@ public:
 	ChannelLayout channel_layout;
 	int frames_per_buffer;
 
+	/* When the source let go of the browser, 0 while it still owns it */
+	uint64_t released_time = 0;
+
+	/* View of a browser created for the pool, empty once a source claimed
+	 * it, see ClaimPooledBrowser() */
+	CefRect pool_rect;
+
 	inline BrowserClient(BrowserSource *bs_, bool sharing_avail, bool reroute_audio_,
 			     ControlLevel webpage_control_level_)
 		: sharing_available(sharing_avail),
@@ -62,6 +69,19 @@ public:
 	{
 	}
 
+	inline void SetControlLevel(ControlLevel level) { webpage_control_level = level; }
+
+	/* Hands a pooled browser over to a source */
+	inline void Attach(BrowserSource *bs_, ControlLevel level)
+	{
+		webpage_control_level = level;
+		pool_rect = CefRect();
+		bs = bs_;
+	}
+
+	static void InjectCSS(CefRefPtr<CefFrame> frame, const std::string &css);
+	static void SendControlLevel(CefRefPtr<CefBrowser> browser, ControlLevel level);
+
 	/* CefClient */
 	virtual CefRefPtr<CefLoadHandler> GetLoadHandler() override;
 	virtual CefRefPtr<CefRenderHandler> GetRenderHandler() override;
@@ -90,6 +110,8 @@ public:
 				   const CefPopupFeatures &popupFeatures, CefWindowInfo &windowInfo,
 				   CefRefPtr<CefClient> &client, CefBrowserSettings &settings,
 				   CefRefPtr<CefDictionaryValue> &extra_info, bool *no_javascript_access) override;
+	virtual void OnAfterCreated(CefRefPtr<CefBrowser> browser) override;
+	virtual void OnBeforeClose(CefRefPtr<CefBrowser> browser) override;
 
 	/* CefRequestHandler */
 	virtual CefRefPtr<CefResourceRequestHandler>
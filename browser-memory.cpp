@@ -0,0 +1,52 @@
+#include "browser-memory.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <libproc.h>
+#else
+#include <cstdio>
+#include <unistd.h>
+#endif
+
+uint64_t GetProcessResidentSize(int pid)
+{
+	if (pid <= 0)
+		return 0;
+
+#if defined(_WIN32)
+	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)pid);
+	if (!process)
+		return 0;
+
+	PROCESS_MEMORY_COUNTERS counters = {};
+	BOOL success = GetProcessMemoryInfo(process, &counters, sizeof(counters));
+	CloseHandle(process);
+	return success ? (uint64_t)counters.WorkingSetSize : 0;
+
+#elif defined(__APPLE__)
+	struct proc_taskinfo info = {};
+	if (proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &info, sizeof(info)) != (int)sizeof(info))
+		return 0;
+	return (uint64_t)info.pti_resident_size;
+
+#else
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	/* Total program size, then resident set size, in pages */
+	unsigned long long size = 0;
+	unsigned long long resident = 0;
+	int fields = fscanf(file, "%llu %llu", &size, &resident);
+	fclose(file);
+
+	if (fields != 2)
+		return 0;
+	return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+}
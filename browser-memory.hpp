@@ -0,0 +1,6 @@
+#pragma once
+
+#include <cstdint>
+
+/* Resident memory of a process in bytes, 0 if it can't be read */
+uint64_t GetProcessResidentSize(int pid);
@@ -0,0 +1,82 @@
+#include "browser-shared-channel.hpp"
+
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+static std::atomic<uint32_t> channel_counter = 0;
+
+static std::string GenerateChannelName()
+{
+	uint32_t id = ++channel_counter;
+
+	/* Kept short, macOS limits shared memory names to 31 characters */
+#ifdef _WIN32
+	return "Local\\obs-browser-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(id);
+#else
+	return "/obsb-" + std::to_string(getpid()) + "-" + std::to_string(id);
+#endif
+}
+
+bool SharedChannelWriter::Create(uint32_t record_size, uint32_t capacity)
+{
+	record_size = (record_size + 7) & ~7u;
+	if (record_size <= sizeof(SharedChannelRecord) || !capacity)
+		return false;
+
+	if (!memory.Create(GenerateChannelName(), GetSharedChannelSize(record_size, capacity)))
+		return false;
+
+	uint8_t *data = (uint8_t *)memory.Data();
+	memset(data, 0, memory.Size());
+
+	SharedChannelHeader *header = new (data) SharedChannelHeader;
+	header->magic = SHARED_CHANNEL_MAGIC;
+	header->version = SHARED_CHANNEL_VERSION;
+	header->record_size = record_size;
+	header->capacity = capacity;
+	header->sequence.store(0, std::memory_order_release);
+
+	for (uint32_t i = 0; i < capacity; i++)
+		new (data + sizeof(SharedChannelHeader) + (size_t)i * record_size) SharedChannelRecord;
+
+	sequence = 0;
+	return true;
+}
+
+bool SharedChannelWriter::Write(uint32_t type, const void *payload, size_t size)
+{
+	uint8_t *data = (uint8_t *)memory.Data();
+	if (!data)
+		return false;
+
+	SharedChannelHeader *header = (SharedChannelHeader *)data;
+	if (size > header->record_size - sizeof(SharedChannelRecord))
+		return false;
+
+	uint32_t index = sequence % header->capacity;
+	uint8_t *slot = data + sizeof(SharedChannelHeader) + (size_t)index * header->record_size;
+	SharedChannelRecord *record = (SharedChannelRecord *)slot;
+
+	/* Readers discard records whose sequence is 0 or changed while
+	 * they were reading them */
+	record->sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	record->type = type;
+	record->size = (uint32_t)size;
+	if (size)
+		memcpy(slot + sizeof(SharedChannelRecord), payload, size);
+
+	if (++sequence == 0)
+		sequence = 1;
+
+	record->sequence.store(sequence, std::memory_order_release);
+	header->sequence.store(sequence, std::memory_order_release);
+	return true;
+}
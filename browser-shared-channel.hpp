@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "shared-memory.hpp"
+
+/* Per-source shared memory channel for high frequency data (meter levels,
+ * timers, ...) that plugins write and pages read without any IPC.
+ *
+ * Layout, every field is a little endian uint32:
+ *
+ *   channel header: magic, version, record_size, capacity, sequence,
+ *                   3 reserved fields
+ *   records:        capacity records of record_size bytes
+ *
+ * Each record starts with its own header (sequence, type, size, reserved)
+ * followed by up to record_size - 16 bytes of payload. A record's sequence
+ * is 0 while it is being written. The channel sequence counts every record
+ * written so far, the latest one is record (sequence - 1) % capacity. */
+
+#define SHARED_CHANNEL_MAGIC 0x4353424f /* "OBSC" */
+#define SHARED_CHANNEL_VERSION 1
+
+struct SharedChannelHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	std::atomic<uint32_t> sequence;
+	uint32_t reserved[3];
+};
+
+struct SharedChannelRecord {
+	std::atomic<uint32_t> sequence;
+	uint32_t type;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(SharedChannelHeader) == 32, "channel header layout is part of the page API");
+static_assert(sizeof(SharedChannelRecord) == 16, "record header layout is part of the page API");
+
+static constexpr uint32_t SHARED_CHANNEL_RECORD_SIZE = 256;
+static constexpr uint32_t SHARED_CHANNEL_CAPACITY = 64;
+
+static inline size_t GetSharedChannelSize(uint32_t record_size, uint32_t capacity)
+{
+	return sizeof(SharedChannelHeader) + (size_t)record_size * capacity;
+}
+
+/* Browser process side, owns the shared memory */
+class SharedChannelWriter {
+	SharedMemory memory;
+	uint32_t sequence = 0;
+
+public:
+	bool Create(uint32_t record_size = SHARED_CHANNEL_RECORD_SIZE, uint32_t capacity = SHARED_CHANNEL_CAPACITY);
+	bool Write(uint32_t type, const void *data, size_t size);
+
+	inline const std::string &Name() const { return memory.Name(); }
+	inline size_t Size() const { return memory.Size(); }
+};
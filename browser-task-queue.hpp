@@ -0,0 +1,312 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/* Priority of a task, lanes are drained in this order */
+enum class TaskLane : int {
+	Input,     /* frame pacing and input */
+	Lifecycle, /* visibility, browser creation and teardown */
+	Event,     /* JS events, call results and state snapshots */
+	Bulk,      /* deferred work, runs when nothing else is queued */
+};
+inline constexpr size_t TASK_LANE_COUNT = 4;
+
+/* Queue of tasks posted by any thread and run by a single consumer.
+ *
+ * Tasks are stored in pooled nodes, and callables up to INLINE_SIZE bytes
+ * are constructed inside the node, so queuing a task usually allocates
+ * nothing. Push() tells the caller when the consumer needs to be woken up:
+ * only one wakeup is pending at a time, and each wakeup drains up to
+ * MAX_DRAIN tasks, or as many as fit in DRAIN_BUDGET.
+ *
+ * Each drain takes the next task from the highest priority lane that isn't
+ * empty. Once a lower lane has a task that waited for STARVATION_LIMIT, the
+ * oldest task of all lanes goes first instead, so a task never runs ahead
+ * of an older one unless that one is in a lower lane. */
+class TaskQueue {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	static constexpr size_t INLINE_SIZE = 64;
+	static constexpr size_t MAX_DRAIN = 64;
+	static constexpr size_t MAX_POOLED = 256;
+	static constexpr std::chrono::microseconds DRAIN_BUDGET{4000};
+	static constexpr std::chrono::milliseconds STARVATION_LIMIT{100};
+
+	struct LaneStats {
+		uint64_t count = 0;
+		uint64_t total_wait_us = 0;
+		uint64_t max_wait_us = 0;
+		uint64_t starved = 0; /* tasks run ahead of higher lanes */
+	};
+
+private:
+	struct Node {
+		Node *next = nullptr;
+		void (*run)(Node *node) = nullptr;
+		void (*destroy)(Node *node) = nullptr;
+		Clock::time_point queued;
+		alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+	};
+
+	struct Lane {
+		Node *head = nullptr;
+		Node *tail = nullptr;
+		LaneStats stats;
+	};
+
+	template<typename F> static constexpr bool FitsInline()
+	{
+		return sizeof(F) <= INLINE_SIZE && alignof(F) <= alignof(std::max_align_t);
+	}
+
+	template<typename F> static F *Inline(Node *node) { return std::launder(reinterpret_cast<F *>(node->storage)); }
+	template<typename F> static F *&Boxed(Node *node)
+	{
+		return *std::launder(reinterpret_cast<F **>(node->storage));
+	}
+
+	std::mutex mutex;
+	Lane lanes[TASK_LANE_COUNT];
+	Node *pool = nullptr;
+	size_t pooled = 0;
+	bool wake_pending = false;
+
+	Node *Acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (pool) {
+				Node *node = pool;
+				pool = node->next;
+				pooled--;
+				node->next = nullptr;
+				return node;
+			}
+		}
+		return new Node;
+	}
+
+	/* Takes the next task to run, with the mutex held */
+	Node *PopLocked(Clock::time_point now)
+	{
+		size_t first = 0;
+		while (first < TASK_LANE_COUNT && !lanes[first].head)
+			first++;
+		if (first == TASK_LANE_COUNT)
+			return nullptr;
+
+		bool starving = false;
+		for (size_t i = first + 1; i < TASK_LANE_COUNT && !starving; i++)
+			starving = lanes[i].head && now - lanes[i].head->queued >= STARVATION_LIMIT;
+
+		size_t pick = first;
+		if (starving) {
+			for (size_t i = first + 1; i < TASK_LANE_COUNT; i++) {
+				if (lanes[i].head && lanes[i].head->queued < lanes[pick].head->queued)
+					pick = i;
+			}
+			if (pick != first)
+				lanes[pick].stats.starved++;
+		}
+
+		Lane &lane = lanes[pick];
+		Node *node = lane.head;
+		lane.head = node->next;
+		if (!lane.head)
+			lane.tail = nullptr;
+		node->next = nullptr;
+
+		auto wait = std::chrono::duration_cast<std::chrono::microseconds>(now - node->queued);
+		uint64_t wait_us = (uint64_t)wait.count();
+		lane.stats.count++;
+		lane.stats.total_wait_us += wait_us;
+		if (wait_us > lane.stats.max_wait_us)
+			lane.stats.max_wait_us = wait_us;
+		return node;
+	}
+
+	bool EmptyLocked() const
+	{
+		for (const Lane &lane : lanes) {
+			if (lane.head)
+				return false;
+		}
+		return true;
+	}
+
+	/* Returns a chain of nodes whose callables were destroyed */
+	void Release(Node *first, Node *last, size_t count)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		while (first && pooled + count > MAX_POOLED) {
+			Node *next = first == last ? nullptr : first->next;
+			delete first;
+			first = next;
+			count--;
+		}
+		if (!first)
+			return;
+
+		last->next = pool;
+		pool = first;
+		pooled += count;
+	}
+
+	size_t DestroyAll(Node *node)
+	{
+		size_t count = 0;
+		for (; node; count++) {
+			Node *next = node->next;
+			node->destroy(node);
+			delete node;
+			node = next;
+		}
+		return count;
+	}
+
+public:
+	TaskQueue() = default;
+	TaskQueue(const TaskQueue &) = delete;
+	TaskQueue &operator=(const TaskQueue &) = delete;
+
+	~TaskQueue()
+	{
+		for (Lane &lane : lanes)
+			DestroyAll(lane.head);
+		while (pool) {
+			Node *next = pool->next;
+			delete pool;
+			pool = next;
+		}
+	}
+
+	/* Returns true if the caller has to wake up the consumer */
+	template<typename Func> bool Push(Func &&func, TaskLane lane_id = TaskLane::Lifecycle)
+	{
+		typedef typename std::decay<Func>::type F;
+
+		Node *node = Acquire();
+		node->queued = Clock::now();
+		if constexpr (FitsInline<F>()) {
+			new (node->storage) F(std::forward<Func>(func));
+			node->run = [](Node *n) {
+				F *f = Inline<F>(n);
+				(*f)();
+				f->~F();
+			};
+			node->destroy = [](Node *n) { Inline<F>(n)->~F(); };
+		} else {
+			new (node->storage) F *(new F(std::forward<Func>(func)));
+			node->run = [](Node *n) {
+				F *f = Boxed<F>(n);
+				(*f)();
+				delete f;
+			};
+			node->destroy = [](Node *n) { delete Boxed<F>(n); };
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		Lane &lane = lanes[(size_t)lane_id];
+		if (lane.tail)
+			lane.tail->next = node;
+		else
+			lane.head = node;
+		lane.tail = node;
+
+		if (wake_pending)
+			return false;
+		wake_pending = true;
+		return true;
+	}
+
+	/* Consumer side. Runs tasks until the queue is empty, MAX_DRAIN tasks
+	 * ran or DRAIN_BUDGET is used up. Returns true if tasks are left, in
+	 * which case the wakeup stays pending and the caller has to wake the
+	 * consumer again. */
+	bool Drain()
+	{
+		Clock::time_point start = Clock::now();
+		Node *first = nullptr;
+		Node *last = nullptr;
+		size_t count = 0;
+		bool more;
+
+		for (;;) {
+			Node *node = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				Clock::time_point now = Clock::now();
+				if (count < MAX_DRAIN && (!count || now - start < DRAIN_BUDGET))
+					node = PopLocked(now);
+
+				if (!node) {
+					more = !EmptyLocked();
+					wake_pending = more;
+					break;
+				}
+			}
+
+			node->run(node);
+
+			if (last)
+				last->next = node;
+			else
+				first = node;
+			last = node;
+			count++;
+		}
+
+		if (count)
+			Release(first, last, count);
+		return more;
+	}
+
+	LaneStats Stats(TaskLane lane)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return lanes[(size_t)lane].stats;
+	}
+
+	/* Called when the consumer couldn't be woken up (CEF isn't running),
+	 * the queued tasks would never run. They are destroyed without running,
+	 * which releases whatever they hold, and the number of tasks dropped
+	 * per lane is returned. */
+	void WakeFailed(size_t dropped[TASK_LANE_COUNT])
+	{
+		Node *heads[TASK_LANE_COUNT];
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 0; i < TASK_LANE_COUNT; i++) {
+				heads[i] = lanes[i].head;
+				lanes[i].head = lanes[i].tail = nullptr;
+			}
+			wake_pending = false;
+		}
+		for (size_t i = 0; i < TASK_LANE_COUNT; i++)
+			dropped[i] = DestroyAll(heads[i]);
+	}
+};
+
+/* Tasks run on the CEF UI thread, see obs-browser-plugin.cpp */
+extern TaskQueue cef_task_queue;
+extern bool WakeCEFTaskQueue();
+extern bool QueueCEFTask(std::function<void()> task);
+
+/* Returns false if the task was dropped. A task queued while a wakeup is
+ * pending is still dropped if that wakeup fails, it is then destroyed
+ * without running, so callers that have to know capture something that
+ * tells them from its destructor. */
+template<typename F> inline bool QueueCEFTask(F &&task, TaskLane lane = TaskLane::Lifecycle)
+{
+	if (!cef_task_queue.Push(std::forward<F>(task), lane))
+		return true;
+	return WakeCEFTaskQueue();
+}
@@ -13,15 +13,18 @@ add_executable(browser-helper)
 add_executable(OBS::browser-helper ALIAS browser-helper)
 
 target_sources(
-  browser-helper PRIVATE # cmake-format: sortable
-                         browser-app.cpp browser-app.hpp cef-headers.hpp obs-browser-page/obs-browser-page-main.cpp)
+  browser-helper
+  PRIVATE # cmake-format: sortable
+          browser-app.cpp browser-app.hpp browser-callback-table.hpp browser-shared-channel.hpp cef-headers.hpp
+          deps/shared-memory-posix.cpp deps/shared-memory.hpp
+          obs-browser-page/obs-browser-page-main.cpp)
 
 target_include_directories(browser-helper PRIVATE "${CMAKE_CURRENT_SOURCE_DIR}/deps"
                                                   "${CMAKE_CURRENT_SOURCE_DIR}/obs-browser-page")
 
 target_link_libraries(browser-helper PRIVATE CEF::Wrapper CEF::Library)
 
-target_sources(obs-browser PRIVATE deps/ip-string-posix.cpp)
+target_sources(obs-browser PRIVATE deps/ip-string-posix.cpp deps/shared-memory-posix.cpp)
 
 set(OBS_EXECUTABLE_DESTINATION "${OBS_PLUGIN_DESTINATION}")
 
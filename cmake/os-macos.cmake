@@ -30,8 +30,11 @@ foreach(helper IN LISTS helper_suffixes)
   add_executable(OBS::${target_name} ALIAS ${target_name})
 
   target_sources(
-    ${target_name} PRIVATE # cmake-format: sortable
-                           browser-app.cpp browser-app.hpp cef-headers.hpp obs-browser-page/obs-browser-page-main.cpp)
+    ${target_name}
+    PRIVATE # cmake-format: sortable
+            browser-app.cpp browser-app.hpp browser-callback-table.hpp browser-shared-channel.hpp cef-headers.hpp
+            deps/shared-memory-posix.cpp deps/shared-memory.hpp
+            obs-browser-page/obs-browser-page-main.cpp)
 
   target_compile_definitions(${target_name} PRIVATE ENABLE_BROWSER_SHARED_TEXTURE)
 
@@ -54,7 +57,7 @@ foreach(helper IN LISTS helper_suffixes)
                "${CMAKE_CURRENT_SOURCE_DIR}/cmake/macos/entitlements-helper${helper_plist}.plist")
 endforeach()
 
-target_sources(obs-browser PRIVATE deps/ip-string-posix.cpp)
+target_sources(obs-browser PRIVATE deps/ip-string-posix.cpp deps/shared-memory-posix.cpp)
 
 set_target_properties(
   obs-browser
@@ -10,7 +10,8 @@ add_executable(OBS::browser-helper ALIAS obs-browser-helper)
 target_sources(
   obs-browser-helper
   PRIVATE # cmake-format: sortable
-          browser-app.cpp browser-app.hpp cef-headers.hpp obs-browser-page.manifest
+          browser-app.cpp browser-app.hpp browser-callback-table.hpp browser-shared-channel.hpp cef-headers.hpp
+          deps/shared-memory-windows.cpp deps/shared-memory.hpp obs-browser-page.manifest
           obs-browser-page/obs-browser-page-main.cpp)
 
 target_include_directories(obs-browser-helper PRIVATE "${CMAKE_CURRENT_SOURCE_DIR}/deps"
@@ -23,7 +24,7 @@ target_link_libraries(obs-browser-helper PRIVATE CEF::Wrapper CEF::Library nlohm
 target_link_options(obs-browser-helper PRIVATE /IGNORE:4099 /SUBSYSTEM:WINDOWS)
 
 target_link_libraries(obs-browser PRIVATE Ws2_32)
-target_sources(obs-browser PRIVATE deps/ip-string-windows.cpp)
+target_sources(obs-browser PRIVATE deps/ip-string-windows.cpp deps/shared-memory-windows.cpp)
 
 set(OBS_EXECUTABLE_DESTINATION "${OBS_PLUGIN_DESTINATION}")
 set_target_properties_obs(
@@ -0,0 +1,75 @@
+#include "shared-memory.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool SharedMemory::Create(const std::string &name_, size_t size_)
+{
+	Close();
+
+	int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return false;
+
+	if (ftruncate(fd, (off_t)size_) != 0) {
+		close(fd);
+		shm_unlink(name_.c_str());
+		return false;
+	}
+
+	void *ptr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (ptr == MAP_FAILED) {
+		shm_unlink(name_.c_str());
+		return false;
+	}
+
+	name = name_;
+	data = ptr;
+	size = size_;
+	owner = true;
+	return true;
+}
+
+bool SharedMemory::Open(const std::string &name_, size_t size_)
+{
+	Close();
+
+	int fd = shm_open(name_.c_str(), O_RDWR, 0);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < size_) {
+		close(fd);
+		return false;
+	}
+
+	void *ptr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (ptr == MAP_FAILED)
+		return false;
+
+	name = name_;
+	data = ptr;
+	size = size_;
+	owner = false;
+	return true;
+}
+
+void SharedMemory::Close()
+{
+	if (data)
+		munmap(data, size);
+	if (owner)
+		shm_unlink(name.c_str());
+
+	name.clear();
+	data = nullptr;
+	size = 0;
+	owner = false;
+}
@@ -0,0 +1,71 @@
+#include "shared-memory.hpp"
+
+#include <cstdint>
+#include <windows.h>
+
+/* Names are generated by obs-browser and plain ASCII */
+
+bool SharedMemory::Create(const std::string &name_, size_t size_)
+{
+	Close();
+
+	DWORD size_high = (DWORD)((uint64_t)size_ >> 32);
+	DWORD size_low = (DWORD)size_;
+	HANDLE mapping =
+		CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, size_high, size_low, name_.c_str());
+	if (!mapping)
+		return false;
+	if (GetLastError() == ERROR_ALREADY_EXISTS) {
+		CloseHandle(mapping);
+		return false;
+	}
+
+	void *ptr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size_);
+	if (!ptr) {
+		CloseHandle(mapping);
+		return false;
+	}
+
+	name = name_;
+	handle = mapping;
+	data = ptr;
+	size = size_;
+	owner = true;
+	return true;
+}
+
+bool SharedMemory::Open(const std::string &name_, size_t size_)
+{
+	Close();
+
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, false, name_.c_str());
+	if (!mapping)
+		return false;
+
+	void *ptr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size_);
+	if (!ptr) {
+		CloseHandle(mapping);
+		return false;
+	}
+
+	name = name_;
+	handle = mapping;
+	data = ptr;
+	size = size_;
+	owner = false;
+	return true;
+}
+
+void SharedMemory::Close()
+{
+	if (data)
+		UnmapViewOfFile(data);
+	if (handle)
+		CloseHandle(handle);
+
+	name.clear();
+	handle = nullptr;
+	data = nullptr;
+	size = 0;
+	owner = false;
+}
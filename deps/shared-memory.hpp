@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/* Named shared memory region, created by one process and mapped by name in
+ * another one */
+class SharedMemory {
+	std::string name;
+	void *data = nullptr;
+	size_t size = 0;
+	bool owner = false;
+#ifdef _WIN32
+	void *handle = nullptr;
+#endif
+
+public:
+	SharedMemory() = default;
+	SharedMemory(const SharedMemory &) = delete;
+	SharedMemory &operator=(const SharedMemory &) = delete;
+	inline ~SharedMemory() { Close(); }
+
+	bool Create(const std::string &name, size_t size);
+	bool Open(const std::string &name, size_t size);
+	void Close();
+
+	inline void *Data() const { return data; }
+	inline size_t Size() const { return size; }
+	inline const std::string &Name() const { return name; }
+};
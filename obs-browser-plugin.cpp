@@ -23,6 +23,9 @@
 #include <util/dstr.hpp>
 #include <obs-module.h>
 #include <obs.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
 #include <functional>
 #include <sstream>
 #include <thread>
@@ -34,6 +37,8 @@
 #include "browser-scheme.hpp"
 #include "browser-app.hpp"
 #include "browser-version.h"
+#include "browser-task-queue.hpp"
+#include "base64/base64.hpp"
 
 #include "cef-headers.hpp"
 
@@ -50,6 +55,8 @@
 #include <obs-nix-platform.h>
 #endif
 
+#include <QObject>
+
 #ifdef ENABLE_BROWSER_QT_LOOP
 #include <QApplication>
 #include <QThread>
@@ -71,6 +78,8 @@ using namespace std;
 static thread manager_thread;
 static bool manager_initialized = false;
 os_event_t *cef_started_event = nullptr;
+static std::atomic<QObject *> frontend_context = nullptr;
+static std::atomic<int> frontend_tasks = 0;
 
 #if defined(_WIN32)
 static int adapterCount = 0;
@@ -85,30 +94,128 @@ bool hwaccel = false;
 extern MessageObject messageObject;
 #endif
 
-class BrowserTask : public CefTask {
-public:
-	std::function<void()> task;
+TaskQueue cef_task_queue;
+
+static void DrainCEFTasks();
 
-	inline BrowserTask(std::function<void()> task_) : task(task_) {}
+/* Posted once per wakeup of the task queue, runs a batch of tasks */
+class DrainTask : public CefTask {
+public:
 	virtual void Execute() override
 	{
 #ifdef ENABLE_BROWSER_QT_LOOP
 		/* you have to put the tasks on the Qt event queue after this
 		 * call otherwise the CEF message pump may stop functioning
 		 * correctly, it's only supposed to take 10ms max */
-		QMetaObject::invokeMethod(&messageObject, "ExecuteTask", Qt::QueuedConnection,
-					  Q_ARG(MessageTask, task));
+		QMetaObject::invokeMethod(&messageObject, "DrainCEFTasks", Qt::QueuedConnection);
 #else
-		task();
+		DrainCEFTasks();
 #endif
 	}
 
-	IMPLEMENT_REFCOUNTING(BrowserTask);
+	IMPLEMENT_REFCOUNTING(DrainTask);
 };
 
+bool WakeCEFTaskQueue()
+{
+	static CefRefPtr<DrainTask> drain_task = new DrainTask();
+	static std::atomic<bool> wake_failed = false;
+
+	if (CefPostTask(TID_UI, drain_task)) {
+		wake_failed = false;
+		return true;
+	}
+
+	/* Callers may have been told their task was queued, tasks dropped
+	 * here tell them otherwise when they are destroyed */
+	size_t dropped[TASK_LANE_COUNT];
+	cef_task_queue.WakeFailed(dropped);
+	if (wake_failed.exchange(true))
+		return false;
+
+	blog(LOG_WARNING,
+	     "[obs-browser]: CEF isn't running, dropped %zu input, %zu lifecycle, %zu event and %zu bulk tasks",
+	     dropped[(size_t)TaskLane::Input], dropped[(size_t)TaskLane::Lifecycle], dropped[(size_t)TaskLane::Event],
+	     dropped[(size_t)TaskLane::Bulk]);
+	return false;
+}
+
+static void DrainCEFTasks()
+{
+	if (cef_task_queue.Drain())
+		WakeCEFTaskQueue();
+}
+
+static void LogCEFTaskStats()
+{
+	static const char *lane_names[TASK_LANE_COUNT] = {
+		"input",
+		"lifecycle",
+		"event",
+		"bulk",
+	};
+
+	for (size_t i = 0; i < TASK_LANE_COUNT; i++) {
+		TaskQueue::LaneStats stats = cef_task_queue.Stats((TaskLane)i);
+		if (!stats.count)
+			continue;
+
+		double avg_ms = (double)stats.total_wait_us / (double)stats.count / 1000.0;
+		blog(LOG_DEBUG,
+		     "[obs-browser]: %" PRIu64 " %s tasks, waited %.2f ms on average, %.2f ms at most, "
+		     "%" PRIu64 " ran ahead of higher lanes",
+		     stats.count, lane_names[i], avg_ms, (double)stats.max_wait_us / 1000.0, stats.starved);
+	}
+}
+
+#ifdef ENABLE_BROWSER_QT_LOOP
+void MessageObject::DrainCEFTasks()
+{
+	::DrainCEFTasks();
+}
+
+static uint32_t max_browser_task_wakeups = 0;
+
+/* Browser tasks are drained in batches, keep track of how many drains end
+ * up on the Qt event queue per frame */
+static void browser_task_tick(void *, float)
+{
+	uint32_t wakeups = messageObject.browserTaskWakeups.exchange(0);
+	if (wakeups > max_browser_task_wakeups)
+		max_browser_task_wakeups = wakeups;
+}
+#endif
+
 bool QueueCEFTask(std::function<void()> task)
 {
-	return CefPostTask(TID_UI, CefRefPtr<BrowserTask>(new BrowserTask(task)));
+	return QueueCEFTask<std::function<void()>>(std::move(task));
+}
+
+/* Runs page calls that query or control the frontend on the UI thread, in
+ * the order they were queued. The connection is queued, so the CEF thread
+ * never waits on the UI thread, and tasks still pending when the module is
+ * unloaded are dropped along with frontend_context. */
+bool QueueFrontendTask(std::function<void()> task)
+{
+	QObject *context = frontend_context;
+	if (!context)
+		return false;
+
+	frontend_tasks++;
+	QMetaObject::invokeMethod(
+		context,
+		[task = std::move(task)]() {
+			task();
+			frontend_tasks--;
+		},
+		Qt::QueuedConnection);
+	return true;
+}
+
+/* Reads answered from the state cache would overtake these */
+bool FrontendTasksPending()
+{
+	return frontend_tasks > 0;
 }
 
 /* ========================================================================= */
@@ -132,6 +239,8 @@ static void browser_source_get_defaults(obs_data_t *settings)
 	obs_data_set_default_bool(settings, "fps_custom", true);
 #endif
 	obs_data_set_default_bool(settings, "shutdown", false);
+	obs_data_set_default_bool(settings, "suspend", false);
+	obs_data_set_default_bool(settings, "preload", false);
 	obs_data_set_default_bool(settings, "restart_when_active", false);
 	obs_data_set_default_int(settings, "webpage_control_level", (int)DEFAULT_CONTROL_LEVEL);
 	obs_data_set_default_string(settings, "css", default_css);
@@ -158,6 +267,15 @@ static bool is_fps_custom(obs_properties_t *props, obs_property_t *, obs_data_t
 	return true;
 }
 
+static bool is_shutdown_modified(obs_properties_t *props, obs_property_t *, obs_data_t *settings)
+{
+	bool enabled = obs_data_get_bool(settings, "shutdown");
+	obs_property_t *suspend = obs_properties_get(props, "suspend");
+	obs_property_set_enabled(suspend, !enabled);
+
+	return true;
+}
+
 static obs_properties_t *browser_source_get_properties(void *data)
 {
 	obs_properties_t *props = obs_properties_create();
@@ -167,10 +285,11 @@ static obs_properties_t *browser_source_get_properties(void *data)
 	obs_properties_set_flags(props, OBS_PROPERTIES_DEFER_UPDATE);
 	obs_property_t *prop = obs_properties_add_bool(props, "is_local_file", obs_module_text("LocalFile"));
 
-	if (bs && !bs->url.empty()) {
+	std::string url = bs ? bs->GetURL() : std::string();
+	if (!url.empty()) {
 		const char *slash;
 
-		dstr_copy(path, bs->url.c_str());
+		dstr_copy(path, url.c_str());
 		dstr_replace(path, "\\", "/");
 		slash = strrchr(path->array, '/');
 		if (slash)
@@ -197,8 +316,11 @@ static obs_properties_t *browser_source_get_properties(void *data)
 
 	obs_property_t *p = obs_properties_add_text(props, "css", obs_module_text("CSS"), OBS_TEXT_MULTILINE);
 	obs_property_text_set_monospace(p, true);
-	obs_properties_add_bool(props, "shutdown", obs_module_text("ShutdownSourceNotVisible"));
+	p = obs_properties_add_bool(props, "shutdown", obs_module_text("ShutdownSourceNotVisible"));
+	obs_property_set_modified_callback(p, is_shutdown_modified);
+	obs_properties_add_bool(props, "suspend", obs_module_text("SuspendSourceNotVisible"));
 	obs_properties_add_bool(props, "restart_when_active", obs_module_text("RefreshBrowserActive"));
+	obs_properties_add_bool(props, "preload", obs_module_text("PreloadOnPreview"));
 
 	obs_property_t *controlLevel = obs_properties_add_list(props, "webpage_control_level",
 							       obs_module_text("WebpageControlLevel"),
@@ -394,15 +516,27 @@ static void BrowserInit(void)
 	os_event_signal(cef_started_event);
 }
 
+extern void CloseReleasedBrowsers(void *, float);
+extern void CloseAllReleasedBrowsers();
+extern void RefillBrowserPool(void *, float);
+extern void CloseBrowserPool();
+
 static void BrowserShutdown(void)
 {
 	CefClearSchemeHandlerFactories();
+	CloseAllReleasedBrowsers();
+	CloseBrowserPool();
 
 #ifdef ENABLE_BROWSER_QT_LOOP
-	while (messageObject.ExecuteNextBrowserTask())
+	while (messageObject.ExecuteBrowserTasks())
 		;
 	CefDoMessageLoopWork();
+
+	blog(LOG_DEBUG, "[obs-browser]: Ran %" PRIu64 " browser tasks, at most %" PRIu32 " drains per frame",
+	     messageObject.browserTaskCount.load(), max_browser_task_wakeups);
+	messageObject.LogPumpStats();
 #endif
+	LogCEFTaskStats();
 	CefShutdown();
 	app = nullptr;
 }
@@ -487,10 +621,7 @@ void RegisterBrowserSource()
 		static_cast<BrowserSource *>(data)->SetShowing(false);
 	};
 	info.activate = [](void *data) {
-		BrowserSource *bs = static_cast<BrowserSource *>(data);
-		if (bs->restart)
-			bs->Refresh();
-		bs->SetActive(true);
+		static_cast<BrowserSource *>(data)->OnActivate();
 	};
 	info.deactivate = [](void *data) {
 		static_cast<BrowserSource *>(data)->SetActive(false);
@@ -502,9 +633,125 @@ void RegisterBrowserSource()
 /* ========================================================================= */
 
 extern void DispatchJSEvent(std::string eventName, std::string jsonString, BrowserSource *browser = nullptr);
+extern void DispatchJSEvent(std::string eventName, std::string jsonString,
+			    const std::vector<BrowserSource *> &browsers);
+extern void DispatchStateSnapshot();
+extern void CheckMemoryBudget(void *, float);
+extern void SetMemoryBudget(uint64_t budget);
+extern uint64_t GetMemoryBudget();
+extern nlohmann::json GetMemoryUsage();
+extern void SetMemoryTrimDelay(uint32_t seconds);
+extern uint32_t GetMemoryTrimDelay();
+extern void SetBrowserPoolSize(uint32_t size);
+extern uint32_t GetBrowserPoolSize();
+
+/* The renderer memory budget, trim delay and browser pool size are plugin
+ * wide settings, kept in the module's config directory and changed through
+ * obs-websocket */
+static void load_memory_settings(void)
+{
+	BPtr<char> path = obs_module_config_path("memory.json");
+	OBSDataAutoRelease data = obs_data_create_from_json_file_safe(path, "bak");
+	if (!data)
+		return;
+
+	SetMemoryBudget((uint64_t)obs_data_get_int(data, "budget_mb") * 1024 * 1024);
+	if (obs_data_has_user_value(data, "trim_after_s"))
+		SetMemoryTrimDelay((uint32_t)obs_data_get_int(data, "trim_after_s"));
+	if (obs_data_has_user_value(data, "pool_size"))
+		SetBrowserPoolSize((uint32_t)obs_data_get_int(data, "pool_size"));
+}
+
+static void save_memory_settings(void)
+{
+	BPtr<char> path = obs_module_config_path("memory.json");
+	OBSDataAutoRelease data = obs_data_create();
+	obs_data_set_int(data, "budget_mb", (long long)(GetMemoryBudget() / (1024 * 1024)));
+	obs_data_set_int(data, "trim_after_s", GetMemoryTrimDelay());
+	obs_data_set_int(data, "pool_size", GetBrowserPoolSize());
+	obs_data_save_json_safe(data, path, "tmp", "bak");
+}
+
+static void update_state_snapshot(enum obs_frontend_event event)
+{
+	switch (event) {
+	case OBS_FRONTEND_EVENT_STREAMING_STARTED:
+	case OBS_FRONTEND_EVENT_STREAMING_STOPPED:
+	case OBS_FRONTEND_EVENT_RECORDING_STARTED:
+	case OBS_FRONTEND_EVENT_RECORDING_PAUSED:
+	case OBS_FRONTEND_EVENT_RECORDING_UNPAUSED:
+	case OBS_FRONTEND_EVENT_RECORDING_STOPPED:
+	case OBS_FRONTEND_EVENT_REPLAY_BUFFER_STARTED:
+	case OBS_FRONTEND_EVENT_REPLAY_BUFFER_STOPPED:
+	case OBS_FRONTEND_EVENT_VIRTUALCAM_STARTED:
+	case OBS_FRONTEND_EVENT_VIRTUALCAM_STOPPED:
+	case OBS_FRONTEND_EVENT_SCENE_CHANGED:
+	case OBS_FRONTEND_EVENT_SCENE_LIST_CHANGED:
+	case OBS_FRONTEND_EVENT_TRANSITION_CHANGED:
+	case OBS_FRONTEND_EVENT_TRANSITION_LIST_CHANGED:
+	case OBS_FRONTEND_EVENT_SCENE_COLLECTION_CHANGED:
+	case OBS_FRONTEND_EVENT_PROFILE_CHANGED:
+	case OBS_FRONTEND_EVENT_FINISHED_LOADING:
+		DispatchStateSnapshot();
+		break;
+	default:;
+	}
+}
+
+/* Video resets don't come with a frontend event, the snapshot is rebuilt
+ * when the canvas size that getCurrentScene reports changes */
+static void check_canvas_size(void *, float)
+{
+	static uint32_t last_cx = 0;
+	static uint32_t last_cy = 0;
+
+	struct obs_video_info ovi;
+	if (!obs_get_video_info(&ovi))
+		return;
+	if (ovi.base_width == last_cx && ovi.base_height == last_cy)
+		return;
+
+	bool first = !last_cx;
+	last_cx = ovi.base_width;
+	last_cy = ovi.base_height;
+	if (!first)
+		QueueFrontendTask(DispatchStateSnapshot);
+}
+
+extern void PreloadSources(const std::unordered_set<obs_source_t *> &preview);
+
+/* In studio mode, browser sources of the preview scene can be loaded ahead
+ * of the transition */
+static void preload_preview_scene(enum obs_frontend_event event)
+{
+	switch (event) {
+	case OBS_FRONTEND_EVENT_PREVIEW_SCENE_CHANGED:
+	case OBS_FRONTEND_EVENT_STUDIO_MODE_ENABLED:
+	case OBS_FRONTEND_EVENT_STUDIO_MODE_DISABLED:
+		break;
+	default:
+		return;
+	}
+
+	std::unordered_set<obs_source_t *> preview;
+	if (obs_frontend_preview_program_mode_active()) {
+		OBSSourceAutoRelease scene = obs_frontend_get_current_preview_scene();
+		auto add_source = [](obs_source_t *, obs_source_t *child, void *param) {
+			static_cast<std::unordered_set<obs_source_t *> *>(param)->insert(child);
+		};
+		if (scene)
+			obs_source_enum_full_tree(scene, add_source, &preview);
+	}
+	PreloadSources(preview);
+}
 
 static void handle_obs_frontend_event(enum obs_frontend_event event, void *)
 {
+	/* Sent ahead of the event so that pages reading the state from
+	 * their event handlers already see the new one */
+	update_state_snapshot(event);
+	preload_preview_scene(event);
+
 	switch (event) {
 	case OBS_FRONTEND_EVENT_STREAMING_STARTING:
 		DispatchJSEvent("obsStreamingStarting", "null");
@@ -718,9 +965,16 @@ bool obs_module_load(void)
 {
 #ifdef ENABLE_BROWSER_QT_LOOP
 	qRegisterMetaType<MessageTask>("MessageTask");
+	obs_add_tick_callback(browser_task_tick, nullptr);
 #endif
+	obs_add_tick_callback(CloseReleasedBrowsers, nullptr);
+	obs_add_tick_callback(CheckMemoryBudget, nullptr);
+	obs_add_tick_callback(RefillBrowserPool, nullptr);
+	obs_add_tick_callback(check_canvas_size, nullptr);
+	load_memory_settings();
 
 	os_event_init(&cef_started_event, OS_EVENT_TYPE_MANUAL);
+	frontend_context = new QObject();
 
 #if defined(_WIN32) && CHROME_VERSION_BUILD < 5615
 	/* CefEnableHighDPISupport doesn't do anything on OS other than Windows. Would also crash macOS at this point as CEF is not directly linked */
@@ -756,30 +1010,194 @@ bool obs_module_load(void)
 	return true;
 }
 
+/* Browser sources an obs-websocket event is sent to, the references keep
+ * them alive until the event is queued */
+struct BrowserTargets {
+	std::vector<OBSSourceAutoRelease> refs;
+	std::vector<BrowserSource *> sources;
+
+	void Add(OBSSourceAutoRelease source)
+	{
+		if (!source || strcmp(obs_source_get_id(source), "browser_source") != 0)
+			return;
+
+		BrowserSource *bs = static_cast<BrowserSource *>(obs_obj_get_data(source));
+		if (!bs || std::find(sources.begin(), sources.end(), bs) != sources.end())
+			return;
+
+		sources.push_back(bs);
+		refs.push_back(std::move(source));
+	}
+};
+
+/* "targets": [{"source_name": ...}, {"source_uuid": ...}, ...], returns
+ * false if there is no target list at all */
+static bool get_browser_targets(obs_data_t *data, BrowserTargets &targets)
+{
+	OBSDataArrayAutoRelease list = obs_data_get_array(data, "targets");
+	if (!list)
+		return false;
+
+	for (size_t i = 0; i < obs_data_array_count(list); i++) {
+		OBSDataAutoRelease target = obs_data_array_item(list, i);
+		const char *uuid = obs_data_get_string(target, "source_uuid");
+
+		if (*uuid)
+			targets.Add(obs_get_source_by_uuid(uuid));
+		else
+			targets.Add(obs_get_source_by_name(obs_data_get_string(target, "source_name")));
+	}
+
+	return true;
+}
+
+static void emit_browser_event(obs_data_t *data, const BrowserTargets *targets)
+{
+	const char *event_name = obs_data_get_string(data, "event_name");
+	if (!event_name || !*event_name)
+		return;
+
+	/* Serialized once, every browser gets the same string */
+	OBSDataAutoRelease event_data = obs_data_get_obj(data, "event_data");
+	const char *event_data_string = event_data ? obs_data_get_json(event_data) : "{}";
+
+	if (!targets)
+		DispatchJSEvent(event_name, event_data_string, nullptr);
+	else if (!targets->sources.empty())
+		DispatchJSEvent(event_name, event_data_string, targets->sources);
+}
+
+static obs_websocket_vendor browser_vendor = nullptr;
+
+void EmitVendorEvent(const char *event_name, const nlohmann::json &event_data)
+{
+	if (!browser_vendor)
+		return;
+
+	OBSDataAutoRelease data = obs_data_create_from_json(event_data.dump().c_str());
+	obs_websocket_vendor_emit_event(browser_vendor, event_name, data);
+}
+
 void obs_module_post_load(void)
 {
 	auto vendor = obs_websocket_register_vendor("obs-browser");
 	if (!vendor)
 		return;
+	browser_vendor = vendor;
 
 	auto emit_event_request_cb = [](obs_data_t *request_data, obs_data_t *, void *) {
-		const char *event_name = obs_data_get_string(request_data, "event_name");
-		if (!event_name)
-			return;
+		BrowserTargets targets;
+		bool targeted = get_browser_targets(request_data, targets);
 
-		OBSDataAutoRelease event_data = obs_data_get_obj(request_data, "event_data");
-		const char *event_data_string = event_data ? obs_data_get_json(event_data) : "{}";
-
-		DispatchJSEvent(event_name, event_data_string, nullptr);
+		emit_browser_event(request_data, targeted ? &targets : nullptr);
 	};
 
 	if (!obs_websocket_vendor_register_request(vendor, "emit_event", emit_event_request_cb, nullptr))
 		blog(LOG_WARNING, "[obs-browser]: Failed to register obs-websocket request emit_event");
+
+	auto emit_events_request_cb = [](obs_data_t *request_data, obs_data_t *, void *) {
+		BrowserTargets targets;
+		bool targeted = get_browser_targets(request_data, targets);
+
+		OBSDataArrayAutoRelease events = obs_data_get_array(request_data, "events");
+		size_t count = obs_data_array_count(events);
+
+		for (size_t i = 0; i < count; i++) {
+			OBSDataAutoRelease event = obs_data_array_item(events, i);
+
+			/* Events can have their own targets, instead of the
+			 * ones of the request */
+			BrowserTargets event_targets;
+			if (get_browser_targets(event, event_targets))
+				emit_browser_event(event, &event_targets);
+			else
+				emit_browser_event(event, targeted ? &targets : nullptr);
+		}
+	};
+
+	if (!obs_websocket_vendor_register_request(vendor, "emit_events", emit_events_request_cb, nullptr))
+		blog(LOG_WARNING, "[obs-browser]: Failed to register obs-websocket request emit_events");
+
+	auto shared_channel_write_request_cb = [](obs_data_t *request_data, obs_data_t *response_data, void *) {
+		const char *source_name = obs_data_get_string(request_data, "source_name");
+		OBSSourceAutoRelease source = obs_get_source_by_name(source_name);
+		if (!source || strcmp(obs_source_get_id(source), "browser_source") != 0) {
+			obs_data_set_bool(response_data, "success", false);
+			obs_data_set_string(response_data, "error", "Browser source not found");
+			return;
+		}
+
+		std::string data = base64_decode(obs_data_get_string(request_data, "data"));
+
+		calldata_t cd = {};
+		calldata_set_int(&cd, "type", obs_data_get_int(request_data, "type"));
+		calldata_set_ptr(&cd, "data", (void *)data.data());
+		calldata_set_int(&cd, "size", (long long)data.size());
+
+		proc_handler_t *ph = obs_source_get_proc_handler(source);
+		proc_handler_call(ph, "shared_channel_write", &cd);
+		obs_data_set_bool(response_data, "success", calldata_bool(&cd, "success"));
+		calldata_free(&cd);
+	};
+
+	if (!obs_websocket_vendor_register_request(vendor, "shared_channel_write", shared_channel_write_request_cb,
+						   nullptr))
+		blog(LOG_WARNING, "[obs-browser]: Failed to register obs-websocket request shared_channel_write");
+
+	auto get_memory_usage_request_cb = [](obs_data_t *, obs_data_t *response_data, void *) {
+		OBSDataAutoRelease usage = obs_data_create_from_json(GetMemoryUsage().dump().c_str());
+		obs_data_apply(response_data, usage);
+	};
+
+	if (!obs_websocket_vendor_register_request(vendor, "get_memory_usage", get_memory_usage_request_cb, nullptr))
+		blog(LOG_WARNING, "[obs-browser]: Failed to register obs-websocket request get_memory_usage");
+
+	auto set_memory_budget_request_cb = [](obs_data_t *request_data, obs_data_t *, void *) {
+		long long budget_mb = obs_data_get_int(request_data, "budget_mb");
+		if (budget_mb < 0)
+			return;
+
+		SetMemoryBudget((uint64_t)budget_mb * 1024 * 1024);
+		save_memory_settings();
+	};
+
+	if (!obs_websocket_vendor_register_request(vendor, "set_memory_budget", set_memory_budget_request_cb, nullptr))
+		blog(LOG_WARNING, "[obs-browser]: Failed to register obs-websocket request set_memory_budget");
+
+	auto set_memory_trim_request_cb = [](obs_data_t *request_data, obs_data_t *, void *) {
+		long long trim_after = obs_data_get_int(request_data, "trim_after_s");
+		if (trim_after < 0 || trim_after > UINT32_MAX)
+			return;
+
+		SetMemoryTrimDelay((uint32_t)trim_after);
+		save_memory_settings();
+	};
+
+	if (!obs_websocket_vendor_register_request(vendor, "set_memory_trim", set_memory_trim_request_cb, nullptr))
+		blog(LOG_WARNING, "[obs-browser]: Failed to register obs-websocket request set_memory_trim");
+
+	auto set_browser_pool_request_cb = [](obs_data_t *request_data, obs_data_t *, void *) {
+		long long size = obs_data_get_int(request_data, "pool_size");
+		if (size < 0 || size > UINT32_MAX)
+			return;
+
+		SetBrowserPoolSize((uint32_t)size);
+		save_memory_settings();
+	};
+
+	if (!obs_websocket_vendor_register_request(vendor, "set_browser_pool", set_browser_pool_request_cb, nullptr))
+		blog(LOG_WARNING, "[obs-browser]: Failed to register obs-websocket request set_browser_pool");
 }
 
 void obs_module_unload(void)
 {
+	obs_remove_tick_callback(CloseReleasedBrowsers, nullptr);
+	obs_remove_tick_callback(CheckMemoryBudget, nullptr);
+	obs_remove_tick_callback(RefillBrowserPool, nullptr);
+	obs_remove_tick_callback(check_canvas_size, nullptr);
+
 #ifdef ENABLE_BROWSER_QT_LOOP
+	obs_remove_tick_callback(browser_task_tick, nullptr);
 	BrowserShutdown();
 #else
 	if (manager_thread.joinable()) {
@@ -790,5 +1208,8 @@ void obs_module_unload(void)
 	}
 #endif
 
+	/* CEF is shut down, nothing queues frontend tasks anymore */
+	delete frontend_context.exchange(nullptr);
+
 	os_event_destroy(cef_started_event);
 }
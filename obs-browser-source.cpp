@@ -19,14 +19,23 @@
 #include "obs-browser-source.hpp"
 #include "browser-client.hpp"
 #include "browser-scheme.hpp"
+#include "browser-task-queue.hpp"
+#include "browser-memory.hpp"
 #include "wide-string.hpp"
 #include <nlohmann/json.hpp>
 #include <util/threading.h>
+#include <util/platform.h>
 #include <QApplication>
 #include <util/dstr.h>
+#include <algorithm>
+#include <cinttypes>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #ifdef __linux__
 #include "linux-keyboard-helpers.hpp"
@@ -43,10 +52,22 @@
 
 using namespace std;
 
-extern bool QueueCEFTask(std::function<void()> task);
+typedef std::vector<std::shared_ptr<BrowserSource>> BrowserList;
 
-static mutex browser_list_mutex;
-static BrowserSource *first_browser = nullptr;
+/* Immutable snapshot of all browser sources. Adding or removing a source
+ * publishes a new snapshot, so iterating doesn't hold browser_list_mutex and
+ * doesn't wait on sources being created or destroyed. Loading the snapshot
+ * isn't wait-free though, std::atomic_load() on a shared_ptr takes a short
+ * internal lock. A removed source is only deleted once the last snapshot
+ * still referencing it has been released, so callers keep the snapshot
+ * they iterate in a variable. */
+static std::shared_ptr<const BrowserList> browser_list = std::make_shared<const BrowserList>();
+static mutex browser_list_mutex; /* serializes writers only */
+
+static inline std::shared_ptr<const BrowserList> GetBrowserList()
+{
+	return std::atomic_load(&browser_list);
+}
 
 static void SendBrowserVisibility(CefRefPtr<CefBrowser> browser, bool isVisible)
 {
@@ -68,6 +89,11 @@ static void SendBrowserVisibility(CefRefPtr<CefBrowser> browser, bool isVisible)
 }
 
 void DispatchJSEvent(std::string eventName, std::string jsonString, BrowserSource *browser = nullptr);
+void DispatchJSBinaryEvent(std::string eventName, const void *data, size_t size, BrowserSource *browser = nullptr);
+extern std::string GetStateSnapshot(ControlLevel webpage_control_level);
+extern std::shared_ptr<const nlohmann::json> UpdateStateCache();
+extern bool QueueFrontendTask(std::function<void()> task);
+static uint64_t GetMemoryFootprint(const BrowserSource *bs);
 
 BrowserSource::BrowserSource(obs_data_t *, obs_source_t *source_) : source(source_)
 {
@@ -93,27 +119,88 @@ BrowserSource::BrowserSource(obs_data_t *, obs_source_t *source_) : source(sourc
 		DispatchJSEvent(eventName, jsonString, (BrowserSource *)p);
 	};
 
+	auto jsBinaryEventFunction = [](void *p, calldata_t *calldata) {
+		const auto eventName = calldata_string(calldata, "eventName");
+		const void *data = calldata_ptr(calldata, "data");
+		long long size = calldata_int(calldata, "size");
+		if (!eventName || size < 0 || (!data && size))
+			return;
+		DispatchJSBinaryEvent(eventName, data, (size_t)size, (BrowserSource *)p);
+	};
+
+	auto sharedChannelFunction = [](void *p, calldata_t *calldata) {
+		const void *data = calldata_ptr(calldata, "data");
+		long long size = calldata_int(calldata, "size");
+		long long type = calldata_int(calldata, "type");
+
+		bool success = size >= 0 && (data || !size) &&
+			       static_cast<BrowserSource *>(p)->WriteSharedChannel((uint32_t)type, data, (size_t)size);
+		calldata_set_bool(calldata, "success", success);
+	};
+
+	auto memoryUsageFunction = [](void *p, calldata_t *calldata) {
+		BrowserSource *bs = static_cast<BrowserSource *>(p);
+		calldata_set_int(calldata, "footprint", (long long)GetMemoryFootprint(bs));
+		calldata_set_int(calldata, "rss", (long long)bs->renderer_rss.load());
+		calldata_set_int(calldata, "js_heap", (long long)bs->js_heap_size.load());
+		calldata_set_int(calldata, "pid", bs->renderer_pid.load());
+	};
+
+	auto loadStatsFunction = [](void *p, calldata_t *calldata) {
+		BrowserSource *bs = static_cast<BrowserSource *>(p);
+		calldata_set_int(calldata, "first_paint_ms", (long long)bs->first_paint_ms.load());
+		calldata_set_int(calldata, "live_ms", (long long)bs->last_live_ms.load());
+	};
+
+	auto crashStatsFunction = [](void *p, calldata_t *calldata) {
+		BrowserSource *bs = static_cast<BrowserSource *>(p);
+		calldata_set_int(calldata, "crash_count", (long long)bs->crash_count.load());
+		calldata_set_int(calldata, "last_recovery_ms", (long long)bs->last_recovery_ms.load());
+		calldata_set_bool(calldata, "recovering", bs->crash_time != 0);
+	};
+
+	signal_handler_t *sh = obs_source_get_signal_handler(source);
+	signal_handler_add(sh, "void browser_crashed(ptr source, int crash_count, bool recovering)");
+	signal_handler_add(sh, "void browser_recovered(ptr source, int recovery_ms)");
+
 	proc_handler_t *ph = obs_source_get_proc_handler(source);
 	proc_handler_add(ph, "void javascript_event(string eventName, string jsonString)", jsEventFunction,
 			 (void *)this);
+	proc_handler_add(ph, "void javascript_binary_event(string eventName, ptr data, int size)",
+			 jsBinaryEventFunction, (void *)this);
+	proc_handler_add(ph, "void get_memory_usage(out int footprint, out int rss, out int js_heap, out int pid)",
+			 memoryUsageFunction, (void *)this);
+	proc_handler_add(ph, "void get_crash_stats(out int crash_count, out int last_recovery_ms, out bool recovering)",
+			 crashStatsFunction, (void *)this);
+	proc_handler_add(ph, "void get_load_stats(out int first_paint_ms, out int live_ms)", loadStatsFunction,
+			 (void *)this);
+	proc_handler_add(ph, "void shared_channel_write(in int type, in ptr data, in int size, out bool success)",
+			 sharedChannelFunction, (void *)this);
 
 	/* defer update */
 	obs_source_update(source, nullptr);
 
+	/* Bulk tasks only run ahead of newer ones, so the source outlives
+	 * every task queued for it before the last reference went away */
+	std::shared_ptr<BrowserSource> self(this, [](BrowserSource *bs) {
+		QueueCEFTask([bs]() { delete bs; }, TaskLane::Bulk);
+	});
+
 	lock_guard<mutex> lock(browser_list_mutex);
-	p_prev_next = &first_browser;
-	next = first_browser;
-	if (first_browser)
-		first_browser->p_prev_next = &next;
-	first_browser = this;
+	auto list = std::make_shared<BrowserList>(*GetBrowserList());
+	list->push_back(std::move(self));
+	std::atomic_store(&browser_list, std::shared_ptr<const BrowserList>(std::move(list)));
 }
 
-static void ActuallyCloseBrowser(CefRefPtr<CefBrowser> cefBrowser)
+/* Detaches the browser from its source, it can be closed at any time after
+ * this */
+static void ReleaseBrowser(CefRefPtr<CefBrowser> cefBrowser)
 {
 	CefRefPtr<CefClient> client = cefBrowser->GetHost()->GetClient();
 	BrowserClient *bc = reinterpret_cast<BrowserClient *>(client.get());
 	if (bc) {
 		bc->bs = nullptr;
+		bc->released_time = os_gettime_ns();
 	}
 
 	/*
@@ -122,9 +209,415 @@ static void ActuallyCloseBrowser(CefRefPtr<CefBrowser> cefBrowser)
          * https://bitbucket.org/chromiumembedded/cef/issues/1363/washidden-api-got-broken-on-branch-2062)
          */
 	cefBrowser->GetHost()->WasHidden(true);
+}
+
+static void ActuallyCloseBrowser(CefRefPtr<CefBrowser> cefBrowser)
+{
+	ReleaseBrowser(cefBrowser);
 	cefBrowser->GetHost()->CloseBrowser(true);
 }
 
+/* Browsers released by sources (settings changes, shutdown when hidden) are
+ * closed later on, a few per frame and only while no browser is waiting to
+ * be created, so closing the browsers of one scene doesn't hold up creating
+ * the ones of the next. */
+#define MAX_CLOSES_PER_FRAME 2
+
+static std::mutex close_mutex;
+static std::deque<CefRefPtr<CefBrowser>> released_browsers;
+static std::atomic<size_t> released_count = 0;
+static std::atomic<int> pending_creates = 0;
+
+/* Counts a browser waiting to be created for as long as the task creating
+ * it exists, whether that task ran or was dropped. A dropped task leaves
+ * the browser to be created by the next tick. */
+struct PendingCreate {
+	BrowserSource *bs;
+	bool started = false;
+
+	inline PendingCreate(BrowserSource *bs_) : bs(bs_) { pending_creates++; }
+	inline ~PendingCreate()
+	{
+		if (!started)
+			bs->create_browser = true;
+		pending_creates--;
+	}
+	PendingCreate(const PendingCreate &) = delete;
+	PendingCreate &operator=(const PendingCreate &) = delete;
+};
+
+static void QueueBrowserClose(CefRefPtr<CefBrowser> cefBrowser)
+{
+	ReleaseBrowser(cefBrowser);
+
+	std::lock_guard<std::mutex> lock(close_mutex);
+	released_browsers.push_back(cefBrowser);
+	released_count = released_browsers.size();
+}
+
+static std::vector<CefRefPtr<CefBrowser>> TakeReleasedBrowsers(size_t max)
+{
+	std::vector<CefRefPtr<CefBrowser>> browsers;
+
+	std::lock_guard<std::mutex> lock(close_mutex);
+	while (!released_browsers.empty() && browsers.size() < max) {
+		browsers.push_back(std::move(released_browsers.front()));
+		released_browsers.pop_front();
+	}
+	released_count = released_browsers.size();
+	return browsers;
+}
+
+/* Tick callback */
+void CloseReleasedBrowsers(void *, float)
+{
+	if (!released_count || pending_creates > 0)
+		return;
+
+	std::vector<CefRefPtr<CefBrowser>> browsers = TakeReleasedBrowsers(MAX_CLOSES_PER_FRAME);
+	if (browsers.empty())
+		return;
+
+	QueueCEFTask(
+		[browsers]() {
+			for (const CefRefPtr<CefBrowser> &browser : browsers)
+				browser->GetHost()->CloseBrowser(true);
+		},
+		TaskLane::Bulk);
+}
+
+/* Called on the CEF thread before shutting it down */
+void CloseAllReleasedBrowsers()
+{
+	for (const CefRefPtr<CefBrowser> &browser : TakeReleasedBrowsers(SIZE_MAX))
+		browser->GetHost()->CloseBrowser(true);
+}
+
+#ifdef ENABLE_BROWSER_SHARED_TEXTURE
+static bool SharedTextureAvailable()
+{
+	obs_enter_graphics();
+#if defined(__APPLE__) || defined(_WIN32)
+	bool available = gs_shared_texture_available();
+#else
+	bool available = obs_cef_all_drm_formats_supported();
+#endif
+	obs_leave_graphics();
+	return available;
+}
+#endif
+
+/* Blank browsers created ahead of time, so that creating a source only has
+ * to navigate one instead of waiting for a new renderer process. Every
+ * POOL_REFILL_INTERVAL seconds, while no source is waiting for its browser
+ * and the renderers fit in the memory budget, one browser is created in the
+ * background with the size a source was most recently created with. Nothing
+ * is pooled until a source was created. Pooled browsers reroute their audio,
+ * which is decided when a browser is created, so only sources that reroute
+ * their audio take one. */
+#define POOL_REFILL_INTERVAL 1.0f
+#define MAX_POOL_SIZE 8
+
+struct PoolKey {
+	int width;
+	int height;
+	bool external_begin_frame;
+
+	inline bool operator==(const PoolKey &other) const
+	{
+		return width == other.width && height == other.height &&
+		       external_begin_frame == other.external_begin_frame;
+	}
+};
+
+struct PooledBrowser {
+	PoolKey key;
+	CefRefPtr<BrowserClient> client;
+	CefRefPtr<CefBrowser> browser; /* null until created */
+	int pid = 0;                   /* renderer process, 0 until reported */
+};
+
+static std::mutex pool_mutex;
+static std::deque<PooledBrowser> browser_pool;
+static std::deque<PoolKey> recent_keys;
+static bool pool_closed = false;
+static std::atomic<uint32_t> pool_size = 1;
+static std::atomic<uint64_t> pool_hits = 0;
+static std::atomic<uint64_t> pool_misses = 0;
+static std::atomic<bool> over_budget = false;
+
+static void RequestMemoryReport(CefRefPtr<CefBrowser> cefBrowser);
+
+void SetBrowserPoolSize(uint32_t size)
+{
+	pool_size = std::min(size, (uint32_t)MAX_POOL_SIZE);
+}
+
+uint32_t GetBrowserPoolSize()
+{
+	return pool_size;
+}
+
+/* Called once a pooled browser exists, on the CEF UI thread */
+void AddPooledBrowser(BrowserClient *client, CefRefPtr<CefBrowser> browser)
+{
+	browser->GetHost()->WasHidden(true);
+
+	bool found = false;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		for (PooledBrowser &pooled : browser_pool) {
+			if (pooled.client.get() == client) {
+				pooled.browser = browser;
+				found = true;
+				break;
+			}
+		}
+	}
+
+	/* The pool was closed or shrunk meanwhile */
+	if (!found) {
+		browser->GetHost()->CloseBrowser(true);
+		return;
+	}
+
+	/* Tells the renderer process, for the memory accounting */
+	RequestMemoryReport(browser);
+}
+
+/* Memory report of a pooled browser, on the CEF UI thread */
+void SetPooledBrowserPid(CefRefPtr<CefBrowser> browser, int pid)
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	for (PooledBrowser &pooled : browser_pool) {
+		if (pooled.browser && pooled.browser->IsSame(browser)) {
+			pooled.pid = pid;
+			break;
+		}
+	}
+}
+
+/* Resident size of the pooled renderers, except the ones shared with
+ * sources, which already count them */
+static uint64_t GetBrowserPoolFootprint(const std::unordered_map<int, size_t> &renderers)
+{
+	std::vector<int> pids;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		for (const PooledBrowser &pooled : browser_pool) {
+			if (pooled.pid && !renderers.count(pooled.pid) &&
+			    std::find(pids.begin(), pids.end(), pooled.pid) == pids.end())
+				pids.push_back(pooled.pid);
+		}
+	}
+
+	uint64_t footprint = 0;
+	for (int pid : pids)
+		footprint += GetProcessResidentSize(pid);
+	return footprint;
+}
+
+/* Closes the pooled browsers to make room for sources, returns how many */
+static size_t EmptyBrowserPool()
+{
+	std::vector<CefRefPtr<CefBrowser>> browsers;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		for (auto it = browser_pool.begin(); it != browser_pool.end();) {
+			if (it->browser) {
+				browsers.push_back(it->browser);
+				it = browser_pool.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	if (!browsers.empty())
+		QueueCEFTask(
+			[browsers]() {
+				for (const CefRefPtr<CefBrowser> &browser : browsers)
+					browser->GetHost()->CloseBrowser(true);
+			},
+			TaskLane::Bulk);
+	return browsers.size();
+}
+
+/* Removes a browser that crashed or failed to be created, null for the
+ * latter */
+void DropPooledBrowser(CefRefPtr<CefBrowser> browser)
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	for (auto it = browser_pool.begin(); it != browser_pool.end(); ++it) {
+		if (it->browser == browser) {
+			browser_pool.erase(it);
+			break;
+		}
+	}
+	if (browser)
+		browser->GetHost()->CloseBrowser(true);
+}
+
+static void CreatePooledBrowser(CefRefPtr<BrowserClient> client, PoolKey key)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		if (pool_closed)
+			return;
+	}
+
+	CefWindowInfo windowInfo;
+	windowInfo.bounds.width = key.width;
+	windowInfo.bounds.height = key.height;
+	windowInfo.windowless_rendering_enabled = true;
+
+	CefBrowserSettings cefBrowserSettings;
+	cefBrowserSettings.windowless_frame_rate = 1;
+	cefBrowserSettings.default_font_size = 16;
+	cefBrowserSettings.default_fixed_font_size = 16;
+
+#ifdef ENABLE_BROWSER_SHARED_TEXTURE
+	windowInfo.shared_texture_enabled = hwaccel;
+#ifdef BROWSER_EXTERNAL_BEGIN_FRAME_ENABLED
+	if (key.external_begin_frame) {
+		windowInfo.external_begin_frame_enabled = true;
+		cefBrowserSettings.windowless_frame_rate = 0;
+	}
+#endif
+#endif
+
+	/* Created without a control level, a renderer process started by
+	 * the first navigation of the source claiming it would otherwise
+	 * reject every call until told the level of that source. Its client
+	 * still allows nothing until claimed. */
+	if (!CefBrowserHost::CreateBrowser(windowInfo, client, "about:blank", cefBrowserSettings, nullptr, nullptr))
+		DropPooledBrowser(nullptr);
+}
+
+/* Takes a browser of the given size if there is one, or any other browser
+ * to resize, on the CEF UI thread */
+static CefRefPtr<CefBrowser> ClaimPooledBrowser(PoolKey key)
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	recent_keys.erase(std::remove(recent_keys.begin(), recent_keys.end(), key), recent_keys.end());
+	recent_keys.push_front(key);
+	if (recent_keys.size() > MAX_POOL_SIZE)
+		recent_keys.pop_back();
+
+	auto found = browser_pool.end();
+	for (auto it = browser_pool.begin(); it != browser_pool.end(); ++it) {
+		if (!it->browser || it->key.external_begin_frame != key.external_begin_frame)
+			continue;
+		if (found == browser_pool.end() || it->key == key)
+			found = it;
+		if (it->key == key)
+			break;
+	}
+
+	if (found == browser_pool.end()) {
+		pool_misses++;
+		return nullptr;
+	}
+
+	CefRefPtr<CefBrowser> browser = found->browser;
+	browser_pool.erase(found);
+	pool_hits++;
+	return browser;
+}
+
+/* Tick callback */
+void RefillBrowserPool(void *, float seconds)
+{
+	static float elapsed = 0.0f;
+	elapsed += seconds;
+	if (elapsed < POOL_REFILL_INTERVAL || pending_creates > 0)
+		return;
+	elapsed = 0.0f;
+
+#ifdef ENABLE_BROWSER_SHARED_TEXTURE
+	bool sharing = hwaccel && SharedTextureAvailable();
+#else
+	bool sharing = false;
+#endif
+
+	std::vector<CefRefPtr<CefBrowser>> extra;
+	CefRefPtr<BrowserClient> client;
+	PoolKey key;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		size_t size = pool_closed ? 0 : pool_size.load();
+		bool refill = !over_budget && !recent_keys.empty();
+
+		while (browser_pool.size() > size && browser_pool.front().browser) {
+			extra.push_back(browser_pool.front().browser);
+			browser_pool.pop_front();
+		}
+
+		/* One browser at a time */
+		bool creating = std::any_of(browser_pool.begin(), browser_pool.end(),
+					    [](const PooledBrowser &pooled) { return !pooled.browser; });
+		if (refill && !creating && browser_pool.size() < size) {
+			/* The most recent sizes first, missing ones are
+			 * filled with the most recent one */
+			std::vector<PoolKey> wanted;
+			for (size_t i = 0; i < size; i++)
+				wanted.push_back(recent_keys[std::min(i, recent_keys.size() - 1)]);
+			for (const PooledBrowser &pooled : browser_pool) {
+				auto it = std::find(wanted.begin(), wanted.end(), pooled.key);
+				if (it != wanted.end())
+					wanted.erase(it);
+			}
+
+			key = wanted.front();
+			client = new BrowserClient(nullptr, sharing, true, ControlLevel::None);
+			client->pool_rect.Set(0, 0, std::max(key.width, 1), std::max(key.height, 1));
+			browser_pool.push_back({key, client, nullptr});
+		}
+	}
+
+	if (!extra.empty() || client) {
+		QueueCEFTask(
+			[extra, client, key]() {
+				for (const CefRefPtr<CefBrowser> &browser : extra)
+					browser->GetHost()->CloseBrowser(true);
+				if (client)
+					CreatePooledBrowser(client, key);
+			},
+			TaskLane::Bulk);
+	}
+}
+
+/* Called at shutdown on the CEF UI thread */
+void CloseBrowserPool()
+{
+	std::deque<PooledBrowser> pool;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		pool_closed = true;
+		pool.swap(browser_pool);
+	}
+
+	for (const PooledBrowser &pooled : pool) {
+		if (pooled.browser)
+			pooled.browser->GetHost()->CloseBrowser(true);
+	}
+}
+
+static nlohmann::json GetBrowserPoolStats()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	size_t ready = (size_t)std::count_if(browser_pool.begin(), browser_pool.end(),
+				     [](const PooledBrowser &pooled) { return !!pooled.browser; });
+
+	return {
+		{"size", pool_size.load()},
+		{"ready", ready},
+		{"hits", pool_hits.load()},
+		{"misses", pool_misses.load()},
+	};
+}
+
 BrowserSource::~BrowserSource()
 {
 	if (cefBrowser)
@@ -134,69 +627,151 @@ BrowserSource::~BrowserSource()
 void BrowserSource::Destroy()
 {
 	destroying = true;
+	suspended = false;
 	DestroyTextures();
 
+	/* Deletion is queued on the CEF thread once no snapshot references
+	 * this source anymore */
 	lock_guard<mutex> lock(browser_list_mutex);
-	if (next)
-		next->p_prev_next = p_prev_next;
-	*p_prev_next = next;
-
-	QueueCEFTask([this]() { delete this; });
+	auto list = std::make_shared<BrowserList>(*GetBrowserList());
+	for (auto it = list->begin(); it != list->end(); ++it) {
+		if (it->get() == this) {
+			list->erase(it);
+			break;
+		}
+	}
+	std::atomic_store(&browser_list, std::shared_ptr<const BrowserList>(std::move(list)));
 }
 
-void BrowserSource::ExecuteOnBrowser(BrowserFunc func, bool async)
+bool BrowserSource::ExecuteOnBrowser(BrowserFunc func, bool async, TaskLane lane)
 {
 	if (!async) {
 #ifdef ENABLE_BROWSER_QT_LOOP
 		if (QThread::currentThread() == qApp->thread()) {
 			if (!!cefBrowser)
 				func(cefBrowser);
-			return;
+			return true;
 		}
 #endif
 		os_event_t *finishedEvent;
 		os_event_init(&finishedEvent, OS_EVENT_TYPE_AUTO);
-		bool success = QueueCEFTask([&]() {
-			if (!!cefBrowser)
-				func(cefBrowser);
-			os_event_signal(finishedEvent);
-		});
+
+		/* Signaled once the task is destroyed, it may be dropped
+		 * without running even after having been queued */
+		std::shared_ptr<void> finished(nullptr, [finishedEvent](void *) { os_event_signal(finishedEvent); });
+		bool ran = false;
+		bool success = QueueCEFTask(
+			[&, finished]() {
+				if (!!cefBrowser)
+					func(cefBrowser);
+				ran = true;
+			},
+			lane);
+		finished.reset();
 		if (success) {
 			os_event_wait(finishedEvent);
 		}
 		os_event_destroy(finishedEvent);
+		return ran;
 	} else {
 		CefRefPtr<CefBrowser> browser = GetBrowser();
-		if (!!browser) {
+		if (!browser)
+			return false;
 #ifdef ENABLE_BROWSER_QT_LOOP
-			QueueBrowserTask(cefBrowser, func);
+		QueueBrowserTask(browser, func);
+		return true;
 #else
-			QueueCEFTask([=]() { func(browser); });
+		return QueueCEFTask([=]() { func(browser); }, lane);
 #endif
+	}
+}
+
+static void FlushInput(CefRefPtr<CefBrowser> cefBrowser, PendingInput &input)
+{
+	bool move;
+	bool wheel;
+	CefMouseEvent move_event;
+	CefMouseEvent wheel_event;
+	int x_delta;
+	int y_delta;
+
+	{
+		std::lock_guard<std::mutex> lock(input.mutex);
+		input.sealed = true;
+		move = input.move;
+		move_event = input.move_event;
+		wheel = input.wheel;
+		wheel_event = input.wheel_event;
+		x_delta = input.x_delta;
+		y_delta = input.y_delta;
+	}
+
+	if (move)
+		cefBrowser->GetHost()->SendMouseMoveEvent(move_event, false);
+	if (wheel)
+		cefBrowser->GetHost()->SendMouseWheelEvent(wheel_event, x_delta, y_delta);
+}
+
+/* Mouse moves and wheel events come in at the polling rate of the device,
+ * merge them into the batch that is already queued if there is one, so the
+ * CEF thread only sends the latest position once per drain. */
+template<typename F> void BrowserSource::CoalesceInput(F &&update)
+{
+	std::lock_guard<std::mutex> lock(inputMutex);
+	if (pendingInput) {
+		std::lock_guard<std::mutex> inputLock(pendingInput->mutex);
+		if (!pendingInput->sealed) {
+			update(*pendingInput);
+			return;
 		}
 	}
+
+	std::shared_ptr<PendingInput> input = std::make_shared<PendingInput>();
+	update(*input);
+
+	auto flush = [input](CefRefPtr<CefBrowser> cefBrowser) { FlushInput(cefBrowser, *input); };
+	if (ExecuteOnBrowser(flush, true, TaskLane::Input))
+		pendingInput = std::move(input);
+	else
+		pendingInput.reset();
+}
+
+/* Events that have to keep their order (clicks, keys, leaving the source)
+ * close the open batch, so moves sent after them can't be merged into it
+ * and overtake them */
+void BrowserSource::SealInput()
+{
+	std::lock_guard<std::mutex> lock(inputMutex);
+	if (!pendingInput)
+		return;
+
+	{
+		std::lock_guard<std::mutex> inputLock(pendingInput->mutex);
+		pendingInput->sealed = true;
+	}
+	pendingInput.reset();
 }
 
 bool BrowserSource::CreateBrowser()
 {
-	return QueueCEFTask([this]() {
+	/* A new page starts out receiving every event */
+	UpdateEventSubscriptions(true, nullptr);
+
+	/* Holds back closing released browsers until this one exists */
+	auto pending = std::make_shared<PendingCreate>(this);
+	last_visible = os_gettime_ns();
+	trimmed = false;
+
+	return QueueCEFTask([this, pending]() {
+		pending->started = true;
+
 #ifdef ENABLE_BROWSER_SHARED_TEXTURE
-		if (hwaccel) {
-			obs_enter_graphics();
-#if defined(__APPLE__) || defined(_WIN32)
-			tex_sharing_avail = gs_shared_texture_available();
-#else
-			tex_sharing_avail = obs_cef_all_drm_formats_supported();
-#endif
-			obs_leave_graphics();
-		}
+		if (hwaccel)
+			tex_sharing_avail = SharedTextureAvailable();
 #else
 		bool hwaccel = false;
 #endif
 
-		CefRefPtr<BrowserClient> browserClient =
-			new BrowserClient(this, hwaccel && tex_sharing_avail, reroute_audio, webpage_control_level);
-
 		CefWindowInfo windowInfo;
 		windowInfo.bounds.width = width;
 		windowInfo.bounds.height = height;
@@ -207,10 +782,12 @@ bool BrowserSource::CreateBrowser()
 #endif
 
 		CefBrowserSettings cefBrowserSettings;
+		bool external_begin_frame = false;
 
 #ifdef ENABLE_BROWSER_SHARED_TEXTURE
 #ifdef BROWSER_EXTERNAL_BEGIN_FRAME_ENABLED
 		if (!fps_custom) {
+			external_begin_frame = true;
 			windowInfo.external_begin_frame_enabled = true;
 			cefBrowserSettings.windowless_frame_rate = 0;
 		} else {
@@ -229,8 +806,33 @@ bool BrowserSource::CreateBrowser()
 		cefBrowserSettings.default_font_size = 16;
 		cefBrowserSettings.default_fixed_font_size = 16;
 
-		auto browser = CefBrowserHost::CreateBrowserSync(windowInfo, browserClient, url, cefBrowserSettings,
-								 CefRefPtr<CefDictionaryValue>(), nullptr);
+		/* Lets the renderer reject calls the page isn't allowed to make
+		 * without asking the browser process. Only the level at creation,
+		 * every new document is sent the current one. */
+		CefRefPtr<CefDictionaryValue> extraInfo = CefDictionaryValue::Create();
+		extraInfo->SetInt("controlLevel", (int)webpage_control_level.load());
+
+		CefRefPtr<CefBrowser> browser;
+		if (reroute_audio)
+			browser = ClaimPooledBrowser({width, height, external_begin_frame});
+
+		if (browser) {
+			CefRefPtr<CefClient> client = browser->GetHost()->GetClient();
+			BrowserClient *bc = reinterpret_cast<BrowserClient *>(client.get());
+			const ControlLevel level = webpage_control_level;
+			bc->Attach(this, level);
+			BrowserClient::SendControlLevel(browser, level);
+
+			if (!external_begin_frame)
+				browser->GetHost()->SetWindowlessFrameRate(cefBrowserSettings.windowless_frame_rate);
+			browser->GetHost()->WasResized();
+			browser->GetMainFrame()->LoadURL(GetURL());
+		} else {
+			CefRefPtr<BrowserClient> browserClient = new BrowserClient(
+				this, hwaccel && tex_sharing_avail, reroute_audio, webpage_control_level);
+			browser = CefBrowserHost::CreateBrowserSync(windowInfo, browserClient, GetURL(),
+								    cefBrowserSettings, extraInfo, nullptr);
+		}
 
 		SetBrowser(browser);
 
@@ -245,13 +847,23 @@ bool BrowserSource::CreateBrowser()
 
 void BrowserSource::DestroyBrowser()
 {
-	ExecuteOnBrowser(ActuallyCloseBrowser, true);
+	suspended = false;
+	SealInput();
+	ExecuteOnBrowser(QueueBrowserClose, true);
 	SetBrowser(nullptr);
+
+	renderer_pid = 0;
+	renderer_rss = 0;
+	js_heap_size = 0;
+	trim_pending = false;
+	preloaded = false;
 }
 
 void BrowserSource::SendMouseClick(const struct obs_mouse_event *event, int32_t type, bool mouse_up,
 				   uint32_t click_count)
 {
+	SealInput();
+
 	uint32_t modifiers = event->modifiers;
 	int32_t x = event->x;
 	int32_t y = event->y;
@@ -265,7 +877,7 @@ void BrowserSource::SendMouseClick(const struct obs_mouse_event *event, int32_t
 			CefBrowserHost::MouseButtonType buttonType = (CefBrowserHost::MouseButtonType)type;
 			cefBrowser->GetHost()->SendMouseClickEvent(e, buttonType, mouse_up, click_count);
 		},
-		true);
+		true, TaskLane::Input);
 }
 
 void BrowserSource::SendMouseMove(const struct obs_mouse_event *event, bool mouse_leave)
@@ -274,6 +886,17 @@ void BrowserSource::SendMouseMove(const struct obs_mouse_event *event, bool mous
 	int32_t x = event->x;
 	int32_t y = event->y;
 
+	if (!mouse_leave) {
+		CoalesceInput([&](PendingInput &input) {
+			input.move = true;
+			input.move_event.modifiers = modifiers;
+			input.move_event.x = x;
+			input.move_event.y = y;
+		});
+		return;
+	}
+
+	SealInput();
 	ExecuteOnBrowser(
 		[=](CefRefPtr<CefBrowser> cefBrowser) {
 			CefMouseEvent e;
@@ -282,7 +905,7 @@ void BrowserSource::SendMouseMove(const struct obs_mouse_event *event, bool mous
 			e.y = y;
 			cefBrowser->GetHost()->SendMouseMoveEvent(e, mouse_leave);
 		},
-		true);
+		true, TaskLane::Input);
 }
 
 void BrowserSource::SendMouseWheel(const struct obs_mouse_event *event, int x_delta, int y_delta)
@@ -291,20 +914,21 @@ void BrowserSource::SendMouseWheel(const struct obs_mouse_event *event, int x_de
 	int32_t x = event->x;
 	int32_t y = event->y;
 
-	ExecuteOnBrowser(
-		[=](CefRefPtr<CefBrowser> cefBrowser) {
-			CefMouseEvent e;
-			e.modifiers = modifiers;
-			e.x = x;
-			e.y = y;
-			cefBrowser->GetHost()->SendMouseWheelEvent(e, x_delta, y_delta);
-		},
-		true);
+	CoalesceInput([&](PendingInput &input) {
+		input.wheel = true;
+		input.wheel_event.modifiers = modifiers;
+		input.wheel_event.x = x;
+		input.wheel_event.y = y;
+		input.x_delta += x_delta;
+		input.y_delta += y_delta;
+	});
 }
 
 void BrowserSource::SendFocus(bool focus)
 {
-	ExecuteOnBrowser([=](CefRefPtr<CefBrowser> cefBrowser) { cefBrowser->GetHost()->SetFocus(focus); }, true);
+	SealInput();
+	ExecuteOnBrowser([=](CefRefPtr<CefBrowser> cefBrowser) { cefBrowser->GetHost()->SetFocus(focus); }, true,
+			 TaskLane::Input);
 }
 
 void BrowserSource::SendKeyClick(const struct obs_key_event *event, bool key_up)
@@ -312,6 +936,8 @@ void BrowserSource::SendKeyClick(const struct obs_key_event *event, bool key_up)
 	if (destroying)
 		return;
 
+	SealInput();
+
 	std::string text = event->text;
 #ifdef __linux__
 	uint32_t native_vkey = KeyboardCodeFromXKeysym(event->native_vkey);
@@ -357,7 +983,7 @@ void BrowserSource::SendKeyClick(const struct obs_key_event *event, bool key_up)
 				cefBrowser->GetHost()->SendKeyEvent(e);
 			}
 		},
-		true);
+		true, TaskLane::Input);
 }
 
 void BrowserSource::SetShowing(bool showing)
@@ -365,15 +991,34 @@ void BrowserSource::SetShowing(bool showing)
 	if (destroying)
 		return;
 
+	std::lock_guard<std::mutex> lock(visibilityMutex);
+
 	is_showing = showing;
+	last_visible = os_gettime_ns();
+	if (showing)
+		trimmed = false;
 
 	if (shutdown_on_invisible) {
 		if (showing) {
-			Update();
+			/* Already has its page */
+			if (preloaded && GetBrowser())
+				SendBrowserVisibility(GetBrowser(), true);
+			else
+				Update();
 		} else {
 			DestroyBrowser();
 		}
 	} else {
+		if (showing) {
+			Resume();
+
+			/* A browser discarded to save memory starts over */
+			if (discarded.exchange(false)) {
+				Update();
+				return;
+			}
+		}
+
 		ExecuteOnBrowser(
 			[=](CefRefPtr<CefBrowser> cefBrowser) {
 				CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("Visibility");
@@ -396,6 +1041,9 @@ void BrowserSource::SetShowing(bool showing)
 		if (showing)
 			return;
 
+		if (suspend_on_invisible)
+			Suspend();
+
 		obs_enter_graphics();
 
 		if (!hwaccel && texture) {
@@ -423,21 +1071,77 @@ void BrowserSource::SetActive(bool active)
 
 void BrowserSource::Refresh()
 {
+	ResetCrashes();
+	HoldFrame();
 	ExecuteOnBrowser([](CefRefPtr<CefBrowser> cefBrowser) { cefBrowser->ReloadIgnoreCache(); }, true);
 }
 
+bool BrowserSource::WriteSharedChannel(uint32_t type, const void *data, size_t size)
+{
+	if (destroying)
+		return false;
+
+	lock_guard<mutex> lock(sharedChannelMutex);
+
+	if (!sharedChannel) {
+		auto channel = std::make_unique<SharedChannelWriter>();
+		if (!channel->Create()) {
+			blog(LOG_WARNING, "[obs-browser: '%s'] Failed to create shared channel",
+			     obs_source_get_name(source));
+			return false;
+		}
+
+		sharedChannel = std::move(channel);
+		ExecuteOnBrowser([this](CefRefPtr<CefBrowser> cefBrowser) { SendSharedChannel(cefBrowser); }, true,
+				 TaskLane::Event);
+	}
+
+	return sharedChannel->Write(type, data, size);
+}
+
+void BrowserSource::SendSharedChannel(CefRefPtr<CefBrowser> browser)
+{
+	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("SharedChannel");
+	CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	{
+		lock_guard<mutex> lock(sharedChannelMutex);
+		if (!sharedChannel)
+			return;
+
+		args->SetString(0, sharedChannel->Name());
+		args->SetInt(1, (int)sharedChannel->Size());
+	}
+	SendBrowserProcessMessage(browser, PID_RENDERER, msg);
+}
+
+/* The browser handle is only ever swapped or copied while lockBrowser is
+ * held, the previous browser is released outside of it */
 void BrowserSource::SetBrowser(CefRefPtr<CefBrowser> b)
 {
-	std::lock_guard<std::recursive_mutex> auto_lock(lockBrowser);
-	cefBrowser = b;
+	{
+		std::lock_guard<std::mutex> auto_lock(lockBrowser);
+		cefBrowser.swap(b);
+	}
 }
 
 CefRefPtr<CefBrowser> BrowserSource::GetBrowser()
 {
-	std::lock_guard<std::recursive_mutex> auto_lock(lockBrowser);
+	std::lock_guard<std::mutex> auto_lock(lockBrowser);
 	return cefBrowser;
 }
 
+std::string BrowserSource::GetURL()
+{
+	std::lock_guard<std::mutex> auto_lock(settingsMutex);
+	return url;
+}
+
+std::string BrowserSource::GetCSS()
+{
+	std::lock_guard<std::mutex> auto_lock(settingsMutex);
+	return css;
+}
+
 #ifdef ENABLE_BROWSER_SHARED_TEXTURE
 #ifdef BROWSER_EXTERNAL_BEGIN_FRAME_ENABLED
 inline void BrowserSource::SignalBeginFrame()
@@ -445,7 +1149,7 @@ inline void BrowserSource::SignalBeginFrame()
 	if (reset_frame) {
 		ExecuteOnBrowser(
 			[](CefRefPtr<CefBrowser> cefBrowser) { cefBrowser->GetHost()->SendExternalBeginFrame(); },
-			true);
+			true, TaskLane::Input);
 
 		reset_frame = false;
 	}
@@ -453,27 +1157,736 @@ inline void BrowserSource::SignalBeginFrame()
 #endif
 #endif
 
-void BrowserSource::Update(obs_data_t *settings)
+static void SetPageFrozen(CefRefPtr<CefBrowser> cefBrowser, bool frozen)
 {
-	if (settings) {
-		bool n_is_local;
-		int n_width;
-		int n_height;
-		bool n_fps_custom;
-		int n_fps;
-		bool n_shutdown;
-		bool n_restart;
-		bool n_reroute;
-		ControlLevel n_webpage_control_level;
-		std::string n_url;
-		std::string n_css;
+	/* Page lifecycle freeze, stops timers and tasks but keeps the DOM */
+	CefRefPtr<CefDictionaryValue> params = CefDictionaryValue::Create();
+	params->SetString("state", frozen ? "frozen" : "active");
+	cefBrowser->GetHost()->ExecuteDevToolsMethod(0, "Page.setWebLifecycleState", params);
+}
 
-		n_is_local = obs_data_get_bool(settings, "is_local_file");
-		n_width = (int)obs_data_get_int(settings, "width");
-		n_height = (int)obs_data_get_int(settings, "height");
-		n_fps_custom = obs_data_get_bool(settings, "fps_custom");
+/* Rate to pass to SetWindowlessFrameRate(), 0 when frames follow the canvas
+ * through external begin frames */
+int BrowserSource::FrameRate() const
+{
+#ifdef ENABLE_BROWSER_SHARED_TEXTURE
+#ifdef BROWSER_EXTERNAL_BEGIN_FRAME_ENABLED
+	return fps_custom ? fps : 0;
+#else
+	return fps_custom ? fps : (int)canvas_fps;
+#endif
+#else
+	return fps;
+#endif
+}
+
+/* Suspended browsers keep their page and renderer process around. They
+ * are only discarded under a memory budget, see CheckMemoryBudget(), and
+ * recreated when shown again. */
+void BrowserSource::Suspend()
+{
+	if (suspended || !GetBrowser())
+		return;
+
+	ExecuteOnBrowser(
+		[](CefRefPtr<CefBrowser> cefBrowser) {
+			cefBrowser->GetHost()->SetAudioMuted(true);
+			cefBrowser->GetHost()->SetWindowlessFrameRate(1);
+			SetPageFrozen(cefBrowser, true);
+		},
+		true);
+
+	suspended = true;
+}
+
+void BrowserSource::Resume()
+{
+	if (suspended.exchange(false)) {
+		bool muted = reroute_audio;
+		int rate = FrameRate();
+		ExecuteOnBrowser(
+			[muted, rate](CefRefPtr<CefBrowser> cefBrowser) {
+				SetPageFrozen(cefBrowser, false);
+				if (rate > 0)
+					cefBrowser->GetHost()->SetWindowlessFrameRate(rate);
+				cefBrowser->GetHost()->SetAudioMuted(muted);
+			},
+			true);
+	}
+}
+
+void BrowserSource::Discard()
+{
+	discarded = true;
+	DestroyBrowser();
+}
+
+/* Discards the source unless it was shown since it was picked, returns
+ * whether it was discarded */
+bool BrowserSource::DiscardHidden()
+{
+	std::lock_guard<std::mutex> lock(visibilityMutex);
+	if (is_showing || destroying)
+		return false;
+
+	Discard();
+	return true;
+}
+
+/* Renderer memory budget in bytes, 0 for none. Every MEMORY_CHECK_INTERVAL
+ * seconds the renderers are asked for a memory report, and while they use
+ * more than the budget, hidden sources are discarded starting with the one
+ * that was visible the longest time ago. */
+#define MEMORY_CHECK_INTERVAL 5.0f
+
+static std::atomic<uint64_t> memory_budget = 0;
+
+void SetMemoryBudget(uint64_t budget)
+{
+	memory_budget = budget;
+}
+
+uint64_t GetMemoryBudget()
+{
+	return memory_budget;
+}
+
+/* Hidden browsers are trimmed once they've been hidden for trim_delay
+ * seconds: the renderer is told memory is critically low, so Blink and Skia
+ * drop their caches, and V8 collects garbage. The page keeps running, which
+ * makes it a lot cheaper than a discard. 0 disables trimming. */
+static std::atomic<uint32_t> trim_delay = 60;
+
+void SetMemoryTrimDelay(uint32_t seconds)
+{
+	trim_delay = seconds;
+}
+
+uint32_t GetMemoryTrimDelay()
+{
+	return trim_delay;
+}
+
+void BrowserSource::UpdateMemoryReport(CefRefPtr<CefBrowser> browser, int pid, uint64_t js_heap)
+{
+	uint64_t rss = GetProcessResidentSize(pid);
+
+	/* Reports of a browser destroyed since are late, DestroyBrowser()
+	 * already cleared them */
+	{
+		std::lock_guard<std::mutex> lock(lockBrowser);
+		if (!cefBrowser || !cefBrowser->IsSame(browser))
+			return;
+
+		renderer_pid = pid;
+		renderer_rss = rss;
+		js_heap_size = js_heap;
+	}
+
+	/* First report since the trim */
+	if (trim_pending.exchange(false)) {
+		uint64_t after = rss ? rss : js_heap;
+		trim_reclaimed = (int64_t)trim_baseline - (int64_t)after;
+		blog(LOG_INFO, "[obs-browser: '%s'] Trimmed hidden browser, %" PRId64 " KiB reclaimed",
+		     obs_source_get_name(source), trim_reclaimed / 1024);
+	}
+}
+
+/* A crashed browser is recreated after CRASH_BACKOFF_MS, doubled for every
+ * other crash within CRASH_WINDOW up to MAX_CRASH_BACKOFF_MS, and given up
+ * on after MAX_CRASHES in that window. Its textures are kept until the new
+ * browser paints, so the last frame stays on screen in the meantime. */
+#define CRASH_WINDOW (10ULL * 60 * 1000000000)
+#define MAX_CRASHES 5
+#define CRASH_BACKOFF_MS 1000ULL
+#define MAX_CRASH_BACKOFF_MS 30000ULL
+
+extern void EmitVendorEvent(const char *event_name, const nlohmann::json &event_data);
+
+void BrowserSource::OnRendererCrashed(const std::string &reason)
+{
+	uint64_t now = os_gettime_ns();
+	size_t recent;
+	{
+		std::lock_guard<std::mutex> lock(crashMutex);
+		crash_times.push_back(now);
+		while (now - crash_times.front() > CRASH_WINDOW)
+			crash_times.pop_front();
+		recent = crash_times.size();
+	}
+
+	uint32_t count = ++crash_count;
+	uint64_t expected = 0;
+	crash_time.compare_exchange_strong(expected, now);
+
+	const char *name = obs_source_get_name(source);
+	bool recovering = recent <= MAX_CRASHES;
+	uint64_t delay_ms = 0;
+
+	if (recovering) {
+		delay_ms = std::min(CRASH_BACKOFF_MS << (recent - 1), MAX_CRASH_BACKOFF_MS);
+		recover_at = now + delay_ms * 1000000;
+		blog(LOG_WARNING, "[obs-browser: '%s'] Restarting the crashed webpage in %" PRIu64 " ms", name,
+		     delay_ms);
+	} else {
+		/* Not recovering anymore, see get_crash_stats */
+		recover_at = 0;
+		crash_time = 0;
+		blog(LOG_ERROR,
+		     "[obs-browser: '%s'] Webpage crashed %zu times in %d minutes, it won't be restarted "
+		     "anymore. Refresh the source to try again.",
+		     name, recent, (int)(CRASH_WINDOW / 60000000000ULL));
+	}
+
+	calldata_t cd = {};
+	calldata_set_ptr(&cd, "source", source);
+	calldata_set_int(&cd, "crash_count", count);
+	calldata_set_bool(&cd, "recovering", recovering);
+	signal_handler_signal(obs_source_get_signal_handler(source), "browser_crashed", &cd);
+	calldata_free(&cd);
+
+	nlohmann::json event = {
+		{"source_name", name},
+		{"source_uuid", obs_source_get_uuid(source)},
+		{"reason", reason},
+		{"crash_count", count},
+		{"recovering", recovering},
+		{"retry_ms", delay_ms},
+	};
+	EmitVendorEvent("browser_crashed", event);
+}
+
+/* Refreshing the source or changing its settings starts over */
+void BrowserSource::ResetCrashes()
+{
+	std::lock_guard<std::mutex> lock(crashMutex);
+	crash_times.clear();
+	recover_at = 0;
+}
+
+/* Called from the graphics thread once the backoff is over. Sources whose
+ * browser was shut down or discarded meanwhile are left alone. */
+void BrowserSource::Recover()
+{
+	if (!GetBrowser()) {
+		crash_time = 0;
+		return;
+	}
+
+	HoldFrame();
+	DestroyBrowser();
+	create_browser = true;
+}
+
+void BrowserSource::OnPageLoaded()
+{
+	recover_at = 0;
+	uint64_t crashed = crash_time.exchange(0);
+	if (!crashed)
+		return;
+
+	uint64_t recovery_ms = (os_gettime_ns() - crashed) / 1000000;
+	last_recovery_ms = recovery_ms;
+
+	const char *name = obs_source_get_name(source);
+	blog(LOG_INFO, "[obs-browser: '%s'] Webpage recovered %" PRIu64 " ms after crashing", name, recovery_ms);
+
+	calldata_t cd = {};
+	calldata_set_ptr(&cd, "source", source);
+	calldata_set_int(&cd, "recovery_ms", (long long)recovery_ms);
+	signal_handler_signal(obs_source_get_signal_handler(source), "browser_recovered", &cd);
+	calldata_free(&cd);
+
+	nlohmann::json event = {
+		{"source_name", name},
+		{"source_uuid", obs_source_get_uuid(source)},
+		{"crash_count", crash_count.load()},
+		{"recovery_ms", recovery_ms},
+	};
+	EmitVendorEvent("browser_recovered", event);
+}
+
+/* While a page (re)loads, paints are dropped and the current texture keeps
+ * being drawn, so the source doesn't flash empty. The hold ends when the
+ * main frame finished loading, or after HOLD_TIMEOUT, and a repaint is then
+ * requested since the page may have painted everything already. */
+#define HOLD_TIMEOUT (5ULL * 1000000000)
+
+void BrowserSource::HoldFrame()
+{
+	uint64_t now = os_gettime_ns();
+	load_start = now;
+	if (texture)
+		hold_since = now;
+}
+
+void BrowserSource::ReleaseFrame(bool timed_out)
+{
+	if (!hold_since.exchange(0))
+		return;
+
+	if (timed_out)
+		blog(LOG_WARNING, "[obs-browser: '%s'] Webpage didn't load within %d seconds, showing it anyway",
+		     obs_source_get_name(source), (int)(HOLD_TIMEOUT / 1000000000));
+
+	ExecuteOnBrowser([](CefRefPtr<CefBrowser> cefBrowser) { cefBrowser->GetHost()->Invalidate(PET_VIEW); }, true,
+			 TaskLane::Input);
+}
+
+/* Called for every paint, returns true if it has to be dropped */
+bool BrowserSource::PaintHeld()
+{
+	if (hold_since)
+		return true;
+
+	uint64_t start = load_start.exchange(0);
+	if (start) {
+		first_paint_ms = (os_gettime_ns() - start) / 1000000;
+		blog(LOG_DEBUG, "[obs-browser: '%s'] First paint %" PRIu64 " ms after load", obs_source_get_name(source),
+		     first_paint_ms.load());
+	}
+
+	uint64_t live = live_time.exchange(0);
+	if (live) {
+		last_live_ms = (os_gettime_ns() - live) / 1000000;
+		blog(LOG_INFO, "[obs-browser: '%s'] First frame %" PRIu64 " ms after going live (%s)",
+		     obs_source_get_name(source), last_live_ms.load(), live_preloaded ? "preloaded" : "cold");
+	}
+	return false;
+}
+
+/* In studio mode, sources set to preload get their page ready while they
+ * are in the preview scene: a browser shut down while hidden is created
+ * hidden, and a browser restarted when active is reloaded now. Once loaded,
+ * the page is frozen and throttled, and going live only has to thaw it. */
+void BrowserSource::Preload()
+{
+	if (preloaded || destroying)
+		return;
+
+	if (!GetBrowser()) {
+		discarded = false;
+		preloaded = true;
+		create_browser = true;
+	} else if (restart) {
+		preloaded = true;
+		Refresh();
+	}
+}
+
+/* Called on the CEF UI thread once the page loaded. The page is frozen
+ * right away, a source going live meanwhile queues its thaw behind it. */
+void BrowserSource::PreloadLoaded(CefRefPtr<CefBrowser> cefBrowser)
+{
+	if (!preloaded)
+		return;
+
+	cefBrowser->GetHost()->SetWindowlessFrameRate(1);
+	SetPageFrozen(cefBrowser, true);
+}
+
+/* The source left the preview scene without going live */
+void BrowserSource::EndPreload()
+{
+	if (!preloaded.exchange(false))
+		return;
+
+	if (shutdown_on_invisible && !obs_source_showing(source))
+		DestroyBrowser();
+	else
+		Thaw();
+}
+
+void BrowserSource::Thaw()
+{
+	int rate = FrameRate();
+	ExecuteOnBrowser(
+		[rate](CefRefPtr<CefBrowser> cefBrowser) {
+			SetPageFrozen(cefBrowser, false);
+			if (rate > 0)
+				cefBrowser->GetHost()->SetWindowlessFrameRate(rate);
+			cefBrowser->GetHost()->Invalidate(PET_VIEW);
+		},
+		true, TaskLane::Input);
+}
+
+void BrowserSource::OnActivate()
+{
+	bool was_preloaded = preloaded.exchange(false);
+
+	/* Only sources that start over when going live are measured */
+	if (was_preloaded || restart || shutdown_on_invisible) {
+		live_preloaded = was_preloaded;
+		live_time = os_gettime_ns();
+	}
+
+	if (was_preloaded)
+		Thaw();
+	else if (restart)
+		Refresh();
+	SetActive(true);
+}
+
+/* Called on the UI thread with the sources of the preview scene, empty when
+ * studio mode is off. Live sources are left to OnActivate(). */
+void PreloadSources(const std::unordered_set<obs_source_t *> &preview)
+{
+	std::shared_ptr<const BrowserList> list = GetBrowserList();
+
+	for (const std::shared_ptr<BrowserSource> &bs : *list) {
+		if (obs_source_active(bs->source))
+			continue;
+
+		if (bs->preload_on_preview && preview.count(bs->source))
+			bs->Preload();
+		else
+			bs->EndPreload();
+	}
+}
+
+static void RequestMemoryReport(CefRefPtr<CefBrowser> cefBrowser)
+{
+	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("MemoryReport");
+	SendBrowserProcessMessage(cefBrowser, PID_RENDERER, msg);
+}
+
+/* Asks for a memory report once the garbage collection of a trim is done,
+ * the report tells how much the trim reclaimed. Keeps itself registered
+ * until then, or until the browser goes away. */
+class TrimObserver : public CefDevToolsMessageObserver {
+	CefRefPtr<CefRegistration> registration;
+	int gc_message_id = 0;
+
+	void Unregister()
+	{
+		/* The registration may hold the last reference to this */
+		CefRefPtr<TrimObserver> self = this;
+		registration = nullptr;
+	}
+
+public:
+	void Trim(CefRefPtr<CefBrowser> cefBrowser)
+	{
+		CefRefPtr<CefBrowserHost> host = cefBrowser->GetHost();
+		registration = host->AddDevToolsMessageObserver(this);
+
+		CefRefPtr<CefDictionaryValue> params = CefDictionaryValue::Create();
+		params->SetString("level", "critical");
+		host->ExecuteDevToolsMethod(0, "Memory.simulatePressureNotification", params);
+		gc_message_id = host->ExecuteDevToolsMethod(0, "HeapProfiler.collectGarbage", nullptr);
+
+		if (!gc_message_id) {
+			Unregister();
+			RequestMemoryReport(cefBrowser);
+		}
+	}
+
+	virtual void OnDevToolsMethodResult(CefRefPtr<CefBrowser> browser, int message_id, bool, const void *,
+					    size_t) override
+	{
+		if (message_id != gc_message_id)
+			return;
+
+		RequestMemoryReport(browser);
+		Unregister();
+	}
+
+	virtual void OnDevToolsAgentDetached(CefRefPtr<CefBrowser>) override { Unregister(); }
+
+	IMPLEMENT_REFCOUNTING(TrimObserver);
+};
+
+static void TrimBrowserMemory(CefRefPtr<CefBrowser> cefBrowser)
+{
+	CefRefPtr<TrimObserver> observer = new TrimObserver();
+	observer->Trim(cefBrowser);
+}
+
+void BrowserSource::Trim()
+{
+	trimmed = true;
+
+	uint64_t rss = renderer_rss;
+	trim_baseline = rss ? rss : js_heap_size.load();
+	trim_pending = trim_baseline != 0;
+
+	ExecuteOnBrowser(TrimBrowserMemory, true, TaskLane::Bulk);
+}
+
+/* Sources can share a renderer process, its resident size is split evenly
+ * between them. Without a resident size, only the V8 heap is counted. */
+static uint64_t GetMemoryFootprint(const BrowserSource *bs, const std::unordered_map<int, size_t> &renderers)
+{
+	uint64_t rss = bs->renderer_rss;
+	if (!rss)
+		return bs->js_heap_size;
+
+	auto renderer = renderers.find(bs->renderer_pid);
+	size_t sharing = renderer != renderers.end() ? renderer->second : 1;
+	return rss / sharing;
+}
+
+static std::unordered_map<int, size_t> CountRendererSources(const BrowserList &list)
+{
+	std::unordered_map<int, size_t> renderers;
+	for (const std::shared_ptr<BrowserSource> &bs : list) {
+		if (bs->renderer_pid && bs->renderer_rss)
+			renderers[bs->renderer_pid]++;
+	}
+	return renderers;
+}
+
+static uint64_t GetMemoryFootprint(const BrowserSource *bs)
+{
+	return GetMemoryFootprint(bs, CountRendererSources(*GetBrowserList()));
+}
+
+nlohmann::json GetMemoryUsage()
+{
+	std::shared_ptr<const BrowserList> list = GetBrowserList();
+	std::unordered_map<int, size_t> renderers = CountRendererSources(*list);
+
+	nlohmann::json pool = GetBrowserPoolStats();
+	uint64_t pool_footprint = GetBrowserPoolFootprint(renderers);
+	pool["footprint"] = pool_footprint;
+
+	nlohmann::json sources = nlohmann::json::array();
+	uint64_t total = pool_footprint;
+	for (const std::shared_ptr<BrowserSource> &bs : *list) {
+		uint64_t footprint = GetMemoryFootprint(bs.get(), renderers);
+		total += footprint;
+
+		sources.push_back({
+			{"source_name", obs_source_get_name(bs->source)},
+			{"source_uuid", obs_source_get_uuid(bs->source)},
+			{"footprint", footprint},
+			{"rss", bs->renderer_rss.load()},
+			{"js_heap", bs->js_heap_size.load()},
+			{"pid", bs->renderer_pid.load()},
+			{"suspended", bs->suspended.load()},
+			{"discarded", bs->discarded.load()},
+			{"trim_reclaimed", bs->trim_reclaimed.load()},
+		});
+	}
+
+	return {
+		{"budget", memory_budget.load()},
+		{"total", total},
+		{"sources", sources},
+		{"pool", pool},
+	};
+}
+
+/* Tick callback */
+void CheckMemoryBudget(void *, float seconds)
+{
+	static float elapsed = 0.0f;
+	elapsed += seconds;
+	if (elapsed < MEMORY_CHECK_INTERVAL)
+		return;
+	elapsed = 0.0f;
+
+	std::shared_ptr<const BrowserList> list = GetBrowserList();
+	uint64_t now = os_gettime_ns();
+	uint64_t delay = (uint64_t)trim_delay * 1000000000ULL;
+
+	/* Reports come back asynchronously and are used by the next check,
+	 * a trim asks for its own report */
+	for (const std::shared_ptr<BrowserSource> &bs : *list) {
+		if (delay && !bs->trimmed && !bs->destroying && !obs_source_showing(bs->source) &&
+		    now - bs->last_visible >= delay && !!bs->GetBrowser())
+			bs->Trim();
+		else
+			bs->ExecuteOnBrowser(RequestMemoryReport, true, TaskLane::Bulk);
+	}
+
+	uint64_t budget = memory_budget;
+	if (!budget) {
+		over_budget = false;
+		return;
+	}
+
+	std::unordered_map<int, size_t> renderers = CountRendererSources(*list);
+	uint64_t pool_footprint = GetBrowserPoolFootprint(renderers);
+	uint64_t total = pool_footprint;
+	std::vector<std::pair<BrowserSource *, uint64_t>> candidates;
+	for (const std::shared_ptr<BrowserSource> &bs : *list) {
+		uint64_t footprint = GetMemoryFootprint(bs.get(), renderers);
+		total += footprint;
+
+		if (footprint && !bs->destroying && !obs_source_showing(bs->source))
+			candidates.emplace_back(bs.get(), footprint);
+	}
+	over_budget = total > budget;
+	if (total <= budget)
+		return;
+
+	/* Pooled browsers go first, and aren't refilled while over budget */
+	if (pool_footprint && EmptyBrowserPool()) {
+		blog(LOG_INFO, "[obs-browser]: Closed pooled browsers, renderers use more than the memory budget");
+		total -= pool_footprint;
+	}
+
+	std::sort(candidates.begin(), candidates.end(),
+		  [](const auto &a, const auto &b) { return a.first->last_visible < b.first->last_visible; });
+
+	for (auto &[bs, footprint] : candidates) {
+		if (total <= budget)
+			break;
+
+		if (!bs->DiscardHidden())
+			continue;
+
+		uint64_t total_mb = total / (1024 * 1024);
+		uint64_t budget_mb = budget / (1024 * 1024);
+		blog(LOG_INFO, "[obs-browser: '%s'] Discarded hidden browser, %" PRIu64 " of %" PRIu64 " MiB in use",
+		     obs_source_get_name(bs->source), total_mb, budget_mb);
+		total -= footprint;
+	}
+}
+
+/* Applies a settings change to the running browser without recreating it */
+void BrowserSource::ApplySettings(bool n_is_local, int n_width, int n_height, bool n_fps_custom, int n_fps,
+				  bool n_shutdown, bool n_suspend, bool n_preload, bool n_restart,
+				  ControlLevel n_webpage_control_level, const std::string &n_url,
+				  const std::string &n_css)
+{
+	std::string changes;
+	auto changed = [&changes](const char *name) {
+		if (!changes.empty())
+			changes += ", ";
+		changes += name;
+	};
+
+	/* Permissions change without reloading the page */
+	if (n_webpage_control_level != webpage_control_level) {
+		webpage_control_level = n_webpage_control_level;
+		SendControlLevel();
+		changed("control level");
+	}
+
+	if (n_width != width || n_height != height) {
+		width = n_width;
+		height = n_height;
+		ExecuteOnBrowser(
+			[=](CefRefPtr<CefBrowser> cefBrowser) {
+				const CefSize cefSize(width, height);
+				cefBrowser->GetHost()->GetClient()->GetDisplayHandler()->OnAutoResize(cefBrowser,
+												      cefSize);
+				cefBrowser->GetHost()->WasResized();
+				cefBrowser->GetHost()->Invalidate(PET_VIEW);
+			},
+			true);
+		changed("size");
+	}
+
+	if (n_fps_custom != fps_custom || n_fps != fps) {
+		fps_custom = n_fps_custom;
+		fps = n_fps;
+
+		int rate = FrameRate();
+		if (rate > 0 && !suspended)
+			ExecuteOnBrowser(
+				[rate](CefRefPtr<CefBrowser> cefBrowser) {
+					cefBrowser->GetHost()->SetWindowlessFrameRate(rate);
+				},
+				true);
+		changed("frame rate");
+	}
+
+	if (n_restart != restart) {
+		restart = n_restart;
+		changed("restart when active");
+	}
+
+	bool reload = n_url != url || n_is_local != is_local;
+	bool css_changed = n_css != css;
+	is_local = n_is_local;
+	{
+		std::lock_guard<std::mutex> lock(settingsMutex);
+		url = n_url;
+		css = n_css;
+	}
+
+	if (css_changed) {
+		/* A page that reloads gets the new CSS once it has loaded */
+		if (!reload) {
+			std::string new_css = css;
+			ExecuteOnBrowser(
+				[new_css](CefRefPtr<CefBrowser> cefBrowser) {
+					BrowserClient::InjectCSS(cefBrowser->GetMainFrame(), new_css);
+				},
+				true);
+		}
+		changed("css");
+	}
+
+	if (reload) {
+		std::string new_url = url;
+		HoldFrame();
+		ExecuteOnBrowser(
+			[new_url](CefRefPtr<CefBrowser> cefBrowser) { cefBrowser->GetMainFrame()->LoadURL(new_url); },
+			true);
+		changed("url");
+	}
+
+	if (n_shutdown != shutdown_on_invisible) {
+		shutdown_on_invisible = n_shutdown;
+		if (shutdown_on_invisible && !obs_source_showing(source))
+			DestroyBrowser();
+		changed("shutdown when not visible");
+	}
+
+	if (n_suspend != suspend_on_invisible) {
+		suspend_on_invisible = n_suspend;
+		if (!suspend_on_invisible)
+			Resume();
+		else if (!shutdown_on_invisible && !obs_source_showing(source))
+			Suspend();
+		changed("suspend when not visible");
+	}
+
+	/* Takes effect the next time the preview scene changes */
+	if (n_preload != preload_on_preview) {
+		preload_on_preview = n_preload;
+		changed("preload on preview");
+	}
+
+	if (!changes.empty())
+		blog(LOG_INFO, "[obs-browser: '%s'] Applied settings change without recreating the browser (%s)",
+		     obs_source_get_name(source), changes.c_str());
+}
+
+void BrowserSource::Update(obs_data_t *settings)
+{
+	int old_width = width;
+	int old_height = height;
+
+	if (settings) {
+		ResetCrashes();
+
+		bool n_is_local;
+		int n_width;
+		int n_height;
+		bool n_fps_custom;
+		int n_fps;
+		bool n_shutdown;
+		bool n_suspend;
+		bool n_preload;
+		bool n_restart;
+		bool n_reroute;
+		ControlLevel n_webpage_control_level;
+		std::string n_url;
+		std::string n_css;
+
+		n_is_local = obs_data_get_bool(settings, "is_local_file");
+		n_width = (int)obs_data_get_int(settings, "width");
+		n_height = (int)obs_data_get_int(settings, "height");
+		n_fps_custom = obs_data_get_bool(settings, "fps_custom");
 		n_fps = (int)obs_data_get_int(settings, "fps");
 		n_shutdown = obs_data_get_bool(settings, "shutdown");
+		n_suspend = obs_data_get_bool(settings, "suspend");
+		n_preload = obs_data_get_bool(settings, "preload");
 		n_restart = obs_data_get_bool(settings, "restart_when_active");
 		n_css = obs_data_get_string(settings, "css");
 		n_url = obs_data_get_string(settings, n_is_local ? "local_file" : "url");
@@ -502,46 +1915,55 @@ void BrowserSource::Update(obs_data_t *settings)
 			n_url = "http://absolute/" + n_url;
 		}
 
-		if (n_is_local == is_local && n_fps_custom == fps_custom && n_fps == fps &&
-		    n_shutdown == shutdown_on_invisible && n_restart == restart && n_css == css && n_url == url &&
-		    n_reroute == reroute_audio && n_webpage_control_level == webpage_control_level) {
-
-			if (n_width == width && n_height == height)
-				return;
+		/* Settings the browser is created with, anything else is applied
+		 * to the running browser */
+		bool recreate = n_reroute != reroute_audio;
+#if defined(BROWSER_EXTERNAL_BEGIN_FRAME_ENABLED) && defined(ENABLE_BROWSER_SHARED_TEXTURE)
+		/* Switches between external begin frames and a fixed rate */
+		recreate = recreate || n_fps_custom != fps_custom;
+#endif
 
-			width = n_width;
-			height = n_height;
-			ExecuteOnBrowser(
-				[=](CefRefPtr<CefBrowser> cefBrowser) {
-					const CefSize cefSize(width, height);
-					cefBrowser->GetHost()->GetClient()->GetDisplayHandler()->OnAutoResize(
-						cefBrowser, cefSize);
-					cefBrowser->GetHost()->WasResized();
-					cefBrowser->GetHost()->Invalidate(PET_VIEW);
-				},
-				true);
+		bool running = !first_update && !!GetBrowser();
+		if (running && !recreate) {
+			ApplySettings(n_is_local, n_width, n_height, n_fps_custom, n_fps, n_shutdown, n_suspend,
+				      n_preload, n_restart, n_webpage_control_level, n_url, n_css);
 			return;
 		}
 
+		if (running)
+			blog(LOG_INFO, "[obs-browser: '%s'] Recreating browser for settings change",
+			     obs_source_get_name(source));
+
 		is_local = n_is_local;
 		width = n_width;
 		height = n_height;
 		fps = n_fps;
 		fps_custom = n_fps_custom;
 		shutdown_on_invisible = n_shutdown;
+		suspend_on_invisible = n_suspend;
+		preload_on_preview = n_preload;
 		reroute_audio = n_reroute;
 		webpage_control_level = n_webpage_control_level;
 		restart = n_restart;
-		css = n_css;
-		url = n_url;
+		{
+			std::lock_guard<std::mutex> lock(settingsMutex);
+			css = n_css;
+			url = n_url;
+		}
 
 		obs_source_set_audio_active(source, reroute_audio);
 	}
 
+	/* The previous frame is held for the new browser unless the size
+	 * changed */
+	bool create = !shutdown_on_invisible || obs_source_showing(source);
 	DestroyBrowser();
-	DestroyTextures();
+	if (create && width == old_width && height == old_height)
+		HoldFrame();
+	else
+		DestroyTextures();
 
-	if (!shutdown_on_invisible || obs_source_showing(source))
+	if (create)
 		create_browser = true;
 
 	first_update = false;
@@ -549,6 +1971,15 @@ void BrowserSource::Update(obs_data_t *settings)
 
 void BrowserSource::Tick()
 {
+	uint64_t now = os_gettime_ns();
+	uint64_t recover = recover_at;
+	if (recover && now >= recover && recover_at.compare_exchange_strong(recover, 0))
+		Recover();
+
+	uint64_t held = hold_since;
+	if (held && now - held > HOLD_TIMEOUT)
+		ReleaseFrame(true);
+
 	if (create_browser && CreateBrowser())
 		create_browser = false;
 #if defined(ENABLE_BROWSER_SHARED_TEXTURE)
@@ -635,41 +2066,219 @@ void BrowserSource::Render()
 #endif
 }
 
-static void ExecuteOnBrowser(BrowserFunc func, BrowserSource *bs)
+/* Events emitted by obs-browser itself, in subscription bit order */
+static const char *builtin_events[] = {
+	"obsSceneChanged",         "obsSceneListChanged",     "obsTransitionChanged",   "obsTransitionListChanged",
+	"obsSourceVisibleChanged", "obsSourceActiveChanged",  "obsStreamingStarting",   "obsStreamingStarted",
+	"obsStreamingStopping",    "obsStreamingStopped",     "obsRecordingStarting",   "obsRecordingStarted",
+	"obsRecordingPaused",      "obsRecordingUnpaused",    "obsRecordingStopping",   "obsRecordingStopped",
+	"obsReplaybufferStarting", "obsReplaybufferStarted",  "obsReplaybufferSaved",   "obsReplaybufferStopping",
+	"obsReplaybufferStopped",  "obsVirtualcamStarted",    "obsVirtualcamStopped",   "obsExit",
+};
+
+static int GetBuiltinEventIndex(const std::string &name)
 {
-	lock_guard<mutex> lock(browser_list_mutex);
+	for (size_t i = 0; i < sizeof(builtin_events) / sizeof(builtin_events[0]); i++) {
+		if (name == builtin_events[i])
+			return (int)i;
+	}
+	return -1;
+}
+
+void BrowserSource::UpdateEventSubscriptions(bool reset, CefRefPtr<CefListValue> names)
+{
+	lock_guard<mutex> lock(subscriptionMutex);
 
-	if (bs) {
-		BrowserSource *bsw = reinterpret_cast<BrowserSource *>(bs);
-		bsw->ExecuteOnBrowser(func, true);
+	if (reset) {
+		subscribed_custom_events.clear();
+		subscribed_events = 0;
+		events_filtered = false;
+		return;
+	}
+
+	uint64_t mask = subscribed_events;
+	for (size_t i = 0; names && i < names->GetSize(); i++) {
+		std::string name = names->GetString(i);
+		int index = GetBuiltinEventIndex(name);
+		if (index >= 0)
+			mask |= 1ULL << index;
+		else
+			subscribed_custom_events.insert(name);
 	}
+
+	subscribed_events = mask;
+	events_filtered = true;
 }
 
-static void ExecuteOnAllBrowsers(BrowserFunc func)
+bool BrowserSource::IsSubscribed(const JSEvent &event)
 {
-	lock_guard<mutex> lock(browser_list_mutex);
+	if (!events_filtered)
+		return true;
+	if (event.builtin_index >= 0)
+		return !!(subscribed_events & (1ULL << event.builtin_index));
 
-	BrowserSource *bs = first_browser;
-	while (bs) {
-		BrowserSource *bsw = reinterpret_cast<BrowserSource *>(bs);
-		bsw->ExecuteOnBrowser(func, true);
-		bs = bs->next;
+	lock_guard<mutex> lock(subscriptionMutex);
+	return subscribed_custom_events.count(event.name) != 0;
+}
+
+static void ExecuteOnBrowser(BrowserFunc func, BrowserSource *bs, const JSEvent &event)
+{
+	if (bs && bs->IsSubscribed(event))
+		bs->ExecuteOnBrowser(func, true, TaskLane::Event);
+}
+
+static void ExecuteOnSubscribedBrowsers(BrowserFunc func, const JSEvent &event)
+{
+	std::shared_ptr<const BrowserList> list = GetBrowserList();
+
+	for (const auto &bs : *list) {
+		if (!bs->destroying && bs->IsSubscribed(event))
+			bs->ExecuteOnBrowser(func, true, TaskLane::Event);
 	}
 }
 
-void DispatchJSEvent(std::string eventName, std::string jsonString, BrowserSource *browser)
+static std::shared_ptr<const JSEvent> CreateJSEvent(std::string eventName, std::string jsonString)
+{
+	/* Checked once here, renderers then use the payload as is */
+	if (!nlohmann::json::accept(jsonString))
+		jsonString = "null";
+
+	const int index = GetBuiltinEventIndex(eventName);
+	return std::make_shared<const JSEvent>(JSEvent{std::move(eventName), std::move(jsonString), index});
+}
+
+static std::shared_ptr<const JSEvent> CreateJSBinaryEvent(std::string eventName, const void *data, size_t size)
+{
+	const int index = GetBuiltinEventIndex(eventName);
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	std::vector<uint8_t> payload(bytes, bytes + size);
+	return std::make_shared<const JSEvent>(
+		JSEvent{std::move(eventName), std::string(), index, true, std::move(payload)});
+}
+
+static BrowserFunc GetJSEventFunc(std::shared_ptr<const JSEvent> event)
 {
-	const auto jsEvent = [=](CefRefPtr<CefBrowser> cefBrowser) {
+	/* Every queued browser task only holds a reference to the event */
+	return [event](CefRefPtr<CefBrowser> cefBrowser) {
 		CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("DispatchJSEvent");
 		CefRefPtr<CefListValue> args = msg->GetArgumentList();
 
-		args->SetString(0, eventName);
-		args->SetString(1, jsonString);
+		args->SetString(0, event->name);
+		if (event->binary)
+			args->SetBinary(1, CefBinaryValue::Create(event->data.data(), event->data.size()));
+		else
+			args->SetString(1, event->json);
 		SendBrowserProcessMessage(cefBrowser, PID_RENDERER, msg);
 	};
+}
+
+void DispatchJSEvent(std::string eventName, std::string jsonString, BrowserSource *browser)
+{
+	const auto event = CreateJSEvent(std::move(eventName), std::move(jsonString));
+	const auto jsEvent = GetJSEventFunc(event);
+
+	if (!browser)
+		ExecuteOnSubscribedBrowsers(jsEvent, *event);
+	else
+		ExecuteOnBrowser(jsEvent, browser, *event);
+}
+
+void DispatchJSBinaryEvent(std::string eventName, const void *data, size_t size, BrowserSource *browser)
+{
+	if (size > MAX_BINARY_VALUE_SIZE) {
+		blog(LOG_WARNING, "[obs-browser]: Dropped binary event '%s', %zu bytes is over the %zu bytes limit",
+		     eventName.c_str(), size, MAX_BINARY_VALUE_SIZE);
+		return;
+	}
+
+	const auto event = CreateJSBinaryEvent(std::move(eventName), data, size);
+	const auto jsEvent = GetJSEventFunc(event);
 
 	if (!browser)
-		ExecuteOnAllBrowsers(jsEvent);
+		ExecuteOnSubscribedBrowsers(jsEvent, *event);
 	else
-		ExecuteOnBrowser(jsEvent, browser);
+		ExecuteOnBrowser(jsEvent, browser, *event);
+}
+
+void DispatchJSEvent(std::string eventName, std::string jsonString, const std::vector<BrowserSource *> &browsers)
+{
+	const auto event = CreateJSEvent(std::move(eventName), std::move(jsonString));
+	const auto jsEvent = GetJSEventFunc(event);
+
+	for (BrowserSource *bs : browsers)
+		ExecuteOnBrowser(jsEvent, bs, *event);
+}
+
+/* Snapshots are numbered so the renderer can drop one that arrives after a
+ * newer one */
+static std::atomic<int> state_version = 0;
+
+static void SendStateSnapshotMessage(CefRefPtr<CefBrowser> cefBrowser, int version, const std::string &json)
+{
+	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("StateSnapshot");
+	CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	args->SetInt(0, version);
+	args->SetString(1, json);
+	SendBrowserProcessMessage(cefBrowser, PID_RENDERER, msg);
+}
+
+void BrowserSource::SendControlLevel()
+{
+	const ControlLevel level = webpage_control_level;
+
+	ExecuteOnBrowser(
+		[this, level](CefRefPtr<CefBrowser> cefBrowser) {
+			CefRefPtr<CefClient> client = cefBrowser->GetHost()->GetClient();
+			BrowserClient *bc = reinterpret_cast<BrowserClient *>(client.get());
+			if (bc)
+				bc->SetControlLevel(level);
+			BrowserClient::SendControlLevel(cefBrowser, level);
+
+			/* What the snapshot holds depends on the level */
+			SendStateSnapshot(cefBrowser);
+		},
+		true);
+}
+
+void BrowserSource::SendStateSnapshot(CefRefPtr<CefBrowser> cefBrowser)
+{
+	/* Building the first snapshot queries the frontend */
+	const ControlLevel level = webpage_control_level;
+
+	QueueFrontendTask([cefBrowser, level]() {
+		const int version = ++state_version;
+		std::string json = GetStateSnapshot(level);
+
+		QueueCEFTask([cefBrowser, version, json]() { SendStateSnapshotMessage(cefBrowser, version, json); },
+			     TaskLane::Event);
+	});
+}
+
+void DispatchStateSnapshot()
+{
+	const int version = ++state_version;
+	UpdateStateCache();
+
+	/* Built once per control level in use */
+	std::shared_ptr<const std::string> snapshots[(int)ControlLevel::All + 1];
+	std::shared_ptr<const BrowserList> list = GetBrowserList();
+
+	for (const auto &bs : *list) {
+		if (bs->destroying)
+			continue;
+
+		const ControlLevel control_level = bs->webpage_control_level;
+		const int level = (int)control_level;
+		if (level < 0 || level > (int)ControlLevel::All)
+			continue;
+		if (!snapshots[level])
+			snapshots[level] = std::make_shared<const std::string>(GetStateSnapshot(control_level));
+
+		std::shared_ptr<const std::string> snapshot = snapshots[level];
+		bs->ExecuteOnBrowser(
+			[version, snapshot](CefRefPtr<CefBrowser> cefBrowser) {
+				SendStateSnapshotMessage(cefBrowser, version, *snapshot);
+			},
+			true, TaskLane::Event);
+	}
 }
@@ -22,34 +22,54 @@
 
 #include "cef-headers.hpp"
 #include "browser-app.hpp"
+#include "browser-shared-channel.hpp"
+#include "browser-task-queue.hpp"
 #include <atomic>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <string>
 #include <mutex>
+#include <unordered_set>
+#include <vector>
 
-enum class ControlLevel : int {
-	None,
-	ReadObs,
-	ReadUser,
-	Basic,
-	Advanced,
-	All,
+extern bool hwaccel;
+
+/* Event payload shared (immutably) by every browser it is delivered to.
+ * builtin_index is the event's bit in the subscription mask, or -1 for
+ * custom events. */
+struct JSEvent {
+	std::string name;
+	std::string json;
+	int builtin_index;
+	bool binary = false;
+	std::vector<uint8_t> data; /* payload of binary events */
 };
-inline constexpr ControlLevel DEFAULT_CONTROL_LEVEL = ControlLevel::ReadObs;
 
-extern bool hwaccel;
+/* Mouse moves and wheel events waiting for the CEF thread. Until the batch
+ * is sealed, new moves replace the pending one and wheel deltas add up. */
+struct PendingInput {
+	std::mutex mutex;
+	bool sealed = false;
+	bool move = false;
+	CefMouseEvent move_event;
+	bool wheel = false;
+	CefMouseEvent wheel_event;
+	int x_delta = 0;
+	int y_delta = 0;
+};
 
 struct BrowserSource {
-	BrowserSource **p_prev_next = nullptr;
-	BrowserSource *next = nullptr;
-
 	obs_source_t *source = nullptr;
 
 	bool tex_sharing_avail = false;
-	bool create_browser = false;
-	std::recursive_mutex lockBrowser;
+	std::atomic<bool> create_browser = false;
+	std::mutex lockBrowser;
 	CefRefPtr<CefBrowser> cefBrowser;
 
+	/* Written by updates only, other threads read them through GetURL()
+	 * and GetCSS() */
+	std::mutex settingsMutex;
 	std::string url;
 	std::string css;
 	gs_texture_t *texture = nullptr;
@@ -73,16 +93,70 @@ struct BrowserSource {
 	double canvas_fps = 0;
 	bool restart = false;
 	bool shutdown_on_invisible = false;
+	bool suspend_on_invisible = false;
+	std::atomic<bool> suspended = false;
+
+	/* Loaded ahead of going live while in the preview scene, see Preload() */
+	bool preload_on_preview = false;
+	std::atomic<bool> preloaded = false;
+	std::atomic<uint64_t> live_time = 0;
+	std::atomic<bool> live_preloaded = false;
+	std::atomic<uint64_t> last_live_ms = 0;
+
+	/* Discarded to save memory, recreated once shown again. Showing the
+	 * source and discarding it are serialized by visibilityMutex. */
+	std::mutex visibilityMutex;
+	std::atomic<bool> discarded = false;
+	std::atomic<uint64_t> last_visible = 0;
+
+	/* Last memory report of the renderer */
+	std::atomic<int> renderer_pid = 0;
+	std::atomic<uint64_t> renderer_rss = 0;
+	std::atomic<uint64_t> js_heap_size = 0;
+
+	/* Trimmed once per hidden period, see Trim() */
+	std::atomic<bool> trimmed = false;
+	std::atomic<bool> trim_pending = false;
+	std::atomic<uint64_t> trim_baseline = 0;
+	std::atomic<int64_t> trim_reclaimed = 0;
+
+	/* Renderer crashes, see OnRendererCrashed() */
+	std::mutex crashMutex;
+	std::deque<uint64_t> crash_times;
+	std::atomic<uint64_t> crash_time = 0;
+	std::atomic<uint64_t> recover_at = 0;
+	std::atomic<uint32_t> crash_count = 0;
+	std::atomic<uint64_t> last_recovery_ms = 0;
+
+	/* Frame held while a page loads, see HoldFrame() */
+	std::atomic<uint64_t> hold_since = 0;
+	std::atomic<uint64_t> load_start = 0;
+	std::atomic<uint64_t> first_paint_ms = 0;
 	bool is_local = false;
 	bool first_update = true;
 	bool reroute_audio = true;
 	std::atomic<bool> destroying = false;
-	ControlLevel webpage_control_level = DEFAULT_CONTROL_LEVEL;
+	std::atomic<ControlLevel> webpage_control_level = DEFAULT_CONTROL_LEVEL; /* also read off the update thread */
 #if defined(BROWSER_EXTERNAL_BEGIN_FRAME_ENABLED) && defined(ENABLE_BROWSER_SHARED_TEXTURE)
 	bool reset_frame = false;
 #endif
 	bool is_showing = false;
 
+	/* Events declared by the page through obsstudio.subscribe(). Until the
+	 * page subscribes to something it receives every event. */
+	std::atomic<bool> events_filtered = false;
+	std::atomic<uint64_t> subscribed_events = 0;
+	std::mutex subscriptionMutex;
+	std::unordered_set<std::string> subscribed_custom_events;
+
+	/* Created on the first write of a producer */
+	std::mutex sharedChannelMutex;
+	std::unique_ptr<SharedChannelWriter> sharedChannel;
+
+	/* Open batch of coalesced mouse input, see CoalesceInput() */
+	std::mutex inputMutex;
+	std::shared_ptr<PendingInput> pendingInput;
+
 	inline void DestroyTextures()
 	{
 		obs_enter_graphics();
@@ -104,7 +178,10 @@ struct BrowserSource {
 
 	bool CreateBrowser();
 	void DestroyBrowser();
-	void ExecuteOnBrowser(BrowserFunc func, bool async = false);
+	bool ExecuteOnBrowser(BrowserFunc func, bool async = false, TaskLane lane = TaskLane::Lifecycle);
+
+	template<typename F> void CoalesceInput(F &&update);
+	void SealInput();
 
 	/* ---------------------------- */
 
@@ -114,6 +191,28 @@ struct BrowserSource {
 	void Destroy();
 
 	void Update(obs_data_t *settings = nullptr);
+	void ApplySettings(bool n_is_local, int n_width, int n_height, bool n_fps_custom, int n_fps, bool n_shutdown,
+			   bool n_suspend, bool n_preload, bool n_restart, ControlLevel n_webpage_control_level,
+			   const std::string &n_url, const std::string &n_css);
+	int FrameRate() const;
+	void Suspend();
+	void Resume();
+	void Preload();
+	void PreloadLoaded(CefRefPtr<CefBrowser> cefBrowser);
+	void EndPreload();
+	void Thaw();
+	void OnActivate();
+	void Discard();
+	bool DiscardHidden();
+	void Trim();
+	void UpdateMemoryReport(CefRefPtr<CefBrowser> browser, int pid, uint64_t js_heap);
+	void OnRendererCrashed(const std::string &reason);
+	void ResetCrashes();
+	void OnPageLoaded();
+	void Recover();
+	void HoldFrame();
+	void ReleaseFrame(bool timed_out);
+	bool PaintHeld();
 	void Tick();
 	void Render();
 
@@ -126,10 +225,22 @@ struct BrowserSource {
 	void SetActive(bool active);
 	void Refresh();
 
+	void UpdateEventSubscriptions(bool reset, CefRefPtr<CefListValue> names);
+	bool IsSubscribed(const JSEvent &event);
+
+	void SendStateSnapshot(CefRefPtr<CefBrowser> cefBrowser);
+	void SendControlLevel();
+
+	bool WriteSharedChannel(uint32_t type, const void *data, size_t size);
+	void SendSharedChannel(CefRefPtr<CefBrowser> browser);
+
 #if defined(BROWSER_EXTERNAL_BEGIN_FRAME_ENABLED) && defined(ENABLE_BROWSER_SHARED_TEXTURE)
 	inline void SignalBeginFrame();
 #endif
 
 	void SetBrowser(CefRefPtr<CefBrowser> b);
 	CefRefPtr<CefBrowser> GetBrowser();
+
+	std::string GetURL();
+	std::string GetCSS();
 };